@@ -0,0 +1,46 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <type_traits>
+#include "igiutilities/igiassert.h"
+
+namespace igi {
+    /// @brief stack whose elements are stored in place, thus it's expected to live on the call stack.
+    /// the capacity is fixed, and callers are responsible for not exceeding it
+    template <typename T, size_t N>
+    class inline_stack {
+        static_assert(std::is_trivially_copyable_v<T>);
+
+        T _elems[N];
+
+        size_t _size;
+
+      public:
+        inline_stack() : _size(0) { }
+
+        inline_stack(const inline_stack &) = delete;
+        inline_stack(inline_stack &&)      = delete;
+
+        static constexpr size_t capacity() {
+            return N;
+        }
+
+        size_t size() const {
+            return _size;
+        }
+
+        bool empty() const {
+            return !_size;
+        }
+
+        void push(const T &e) {
+            igiassert(_size < N);
+            _elems[_size++] = e;
+        }
+
+        T pop() {
+            igiassert(_size);
+            return _elems[--_size];
+        }
+    };
+}  // namespace igi
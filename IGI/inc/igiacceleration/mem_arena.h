@@ -31,6 +31,13 @@ namespace igi {
 
             size_t getAlign() noexcept { return _align; }
 
+            size_t getSize() noexcept { return _size; }
+
+            /// @brief makes the whole chunk available again
+            void rewind() noexcept {
+                _available = reinterpret_cast<char *>(this) + (sizeof(chunk) < _align ? _align : sizeof(chunk));
+            }
+
             void *tryAlloc(size_t size, size_t align) noexcept {
                 char *thisp = reinterpret_cast<char *>(this);
                 char *alloc = reinterpret_cast<char *>(ceilAddr(_available, align));
@@ -47,6 +54,16 @@ namespace igi {
                 _available  = reinterpret_cast<char *>(_available) + size;
                 return alloc;
             }
+
+            /// @brief reclaims the allocation if it's the latest one of the chunk
+            void tryFree(void *ptr, size_t size) noexcept {
+                if (reinterpret_cast<char *>(ptr) + size == _available)
+                    _available = ptr;
+            }
+
+            void *getAvailable() noexcept { return _available; }
+
+            void setAvailable(void *available) noexcept { _available = available; }
         };
 
         class chunk_list {
@@ -74,11 +91,42 @@ namespace igi {
             }
 
             bool isEmpty() noexcept { return _last == nullptr; }
+
+            bool isSingle() noexcept { return _last && !_last->getPrev(); }
         };
 
         chunk_list _chunks;
 
       public:
+        /// @brief position of the arena, allocations after which are reclaimed by `rewind`
+        class marker {
+            friend class mem_arena;
+
+            chunk *_chunk    = nullptr;
+            void *_available = nullptr;
+
+          public:
+            marker() = default;
+        };
+
+        /// @brief rewinds the arena to where it's marked on construction once destroyed
+        class scope {
+            mem_arena *const _arena;
+            const marker _marker;
+
+          public:
+            /// @param arena null for a scope doing nothing
+            explicit scope(mem_arena *arena) noexcept : _arena(arena), _marker(arena ? arena->mark() : marker()) { }
+
+            scope(const scope &)            = delete;
+            scope &operator=(const scope &) = delete;
+
+            ~scope() {
+                if (_arena)
+                    _arena->rewind(_marker);
+            }
+        };
+
         mem_arena(size_t init_size = MinChunkSize, size_t align = alignof(void *)) noexcept
             : _chunks(init_size, align) { }
         mem_arena(const mem_arena &)     = delete;
@@ -91,13 +139,53 @@ namespace igi {
                 _chunks.releaseLast();
         }
 
+        /// @brief reclaims all allocations while keeping the arena usable, unlike `release`.
+        /// chunks are merged into one of their total size, so that the same allocations fit in it next time
+        void reset() noexcept {
+            if (_chunks.isEmpty())
+                return;
+            if (_chunks.isSingle()) {
+                _chunks.getLast().rewind();
+                return;
+            }
+
+            size_t size = 0, align = _chunks.getLast().getAlign();
+            while (!_chunks.isEmpty()) {
+                size += _chunks.getLast().getSize();
+                _chunks.releaseLast();
+            }
+            _chunks.allocChunk(size, align);
+        }
+
+        marker mark() noexcept {
+            marker res;
+            if (!_chunks.isEmpty()) {
+                res._chunk     = &_chunks.getLast();
+                res._available = res._chunk->getAvailable();
+            }
+            return res;
+        }
+
+        /// @brief reclaims allocations made after `m`, chunks allocated since then are released.
+        /// markers are expected to be rewound in reverse order of marking, and are invalidated by `release` and `reset`
+        void rewind(const marker &m) noexcept {
+            while (!_chunks.isEmpty() && &_chunks.getLast() != m._chunk)
+                _chunks.releaseLast();
+            if (!_chunks.isEmpty())
+                _chunks.getLast().setAvailable(m._available);
+        }
+
       private:
         void *do_allocate(size_t bytes, size_t align) override {
-            void *alloc = _chunks.getLast().tryAlloc(bytes, align);
+            void *alloc = _chunks.isEmpty() ? nullptr : _chunks.getLast().tryAlloc(bytes, align);
             return alloc ? alloc : _chunks.allocChunk(bytes, align).alloc(bytes);
         }
 
-        void do_deallocate(void *ptr, size_t bytes, size_t align) override { }
+        // the latest allocation is reclaimed at once, others are left to `rewind`, `reset` or `release`
+        void do_deallocate(void *ptr, size_t bytes, size_t) override {
+            if (!_chunks.isEmpty())
+                _chunks.getLast().tryFree(ptr, bytes);
+        }
 
         bool do_is_equal(const memory_resource &o) const noexcept override {
             return &o == this;
@@ -0,0 +1,286 @@
+﻿#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory_resource>
+#include <mutex>
+#include <thread>
+#include "igiacceleration/circular_list.h"
+#include "igicontext.h"
+
+namespace igi {
+    /// @brief persistent workers, each of which owns a task deque.
+    /// a worker pushes and pops tasks at the back of its own deque, and steals from the front of others' once it runs out of tasks
+    class thread_pool {
+      public:
+        /// @brief counts unfinished tasks submitted with it, a task may submit more tasks to the group it belongs to
+        class task_group {
+            friend class thread_pool;
+
+            std::atomic<size_t> _pending;
+
+          public:
+            task_group() : _pending(0) { }
+            task_group(const task_group &) = delete;
+            task_group(task_group &&)      = delete;
+
+            bool done() const {
+                return !_pending.load(std::memory_order_acquire);
+            }
+        };
+
+        static constexpr size_t TaskStorageSize = 48;
+
+        static constexpr size_t SlotNull = ~static_cast<size_t>(0);
+
+        /// @brief number of threads outside the pool which are able to run tasks while waiting at the same time,
+        /// any further waiter blocks without running tasks
+        static constexpr size_t ExternalSlotCount = 4;
+
+        static inline const size_t DefaultWorkerCount = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+
+      private:
+        struct task {
+            using invoke_t = void (*)(const void *, size_t);
+
+            invoke_t invoke;
+
+            task_group *group;
+
+            alignas(std::max_align_t) std::byte storage[TaskStorageSize];
+        };
+
+        struct worker {
+            std::mutex mutex;
+
+            // grows on whichever thread pushes to it, thus it doesn't allocate from `context`
+            circular_list<task> tasks;
+
+            std::thread thread;
+
+            worker() : tasks(64, std::pmr::new_delete_resource()) {
+                tasks.clear();
+            }
+        };
+
+        static inline thread_local const thread_pool *CurrentPool = nullptr;
+
+        static inline thread_local size_t CurrentSlot = SlotNull;
+
+        std::shared_ptr<worker[]> _workers;
+
+        size_t _workerCount;
+
+        std::atomic<size_t> _epoch;
+
+        // bumped whenever a group runs out of tasks, the group itself might be gone once its waiter returns
+        std::atomic<size_t> _finished;
+
+        std::atomic<size_t> _roundRobin;
+
+        // bit i is set while an outside thread holds slot `_workerCount + i`
+        std::atomic<size_t> _externalSlots;
+
+        std::atomic<bool> _exit;
+
+      public:
+        explicit thread_pool(size_t workerCount = DefaultWorkerCount)
+            : _workers(context::AllocateSharedArray<worker>(workerCount)), _workerCount(workerCount),
+              _epoch(0), _finished(0), _roundRobin(0), _externalSlots(0), _exit(false) {
+            igiassert(workerCount > 0);
+
+            for (size_t i = 0; i < _workerCount; i++)
+                context::Construct(&_workers[i]);
+            for (size_t i = 0; i < _workerCount; i++)
+                _workers[i].thread = std::thread(Work, this, i);
+        }
+
+        thread_pool(const thread_pool &) = delete;
+        thread_pool(thread_pool &&)      = delete;
+
+        ~thread_pool() {
+            // the flag is stored before the epoch is bumped, thus a worker seeing the new epoch sees the flag as well
+            _exit.store(true, std::memory_order_release);
+            _epoch.fetch_add(1, std::memory_order_release);
+            _epoch.notify_all();
+
+            for (size_t i = 0; i < _workerCount; i++)
+                _workers[i].thread.join();
+            context::Destroy(_workers.get(), _workerCount);
+        }
+
+        /// @brief the pool shared by all parallel callers which don't bring their own
+        static thread_pool &GetDefault() {
+            static thread_pool Default;
+            return Default;
+        }
+
+        size_t getWorkerCount() const {
+            return _workerCount;
+        }
+
+        /// @brief number of distinct slots, i.e., one for each worker and `ExternalSlotCount` for threads outside the pool
+        size_t getSlotCount() const {
+            return _workerCount + ExternalSlotCount;
+        }
+
+        /// @brief slot of the calling thread, which is in [0, getSlotCount()),
+        /// or `SlotNull` if it's neither a worker nor an outside thread waiting in this pool
+        size_t getCurrentSlot() const {
+            return CurrentPool == this ? CurrentSlot : SlotNull;
+        }
+
+        /// @param fn is invoked as `fn(slot)`, it's copied bitwise into the task, thus is required to be trivially copyable
+        template <typename TFn>
+        void submit(task_group &group, TFn &&fn) {
+            using fn_t = std::remove_cvref_t<TFn>;
+
+            static_assert(std::is_trivially_copyable_v<fn_t>, "task is copied bitwise between deques");
+            static_assert(sizeof(fn_t) <= TaskStorageSize && alignof(fn_t) <= alignof(std::max_align_t),
+                          "task is too large to be stored inline");
+
+            task t;
+            t.invoke = [](const void *storage, size_t slot) {
+                (*static_cast<const fn_t *>(storage))(slot);
+            };
+            t.group = &group;
+            new (t.storage) fn_t(std::forward<TFn>(fn));
+
+            group._pending.fetch_add(1, std::memory_order_relaxed);
+
+            const size_t slot = getCurrentSlot();
+            worker &w         = _workers[slot < _workerCount ? slot : _roundRobin.fetch_add(1, std::memory_order_relaxed) % _workerCount];
+            {
+                std::lock_guard<std::mutex> lock(w.mutex);
+                w.tasks.push_back(t);
+            }
+
+            _epoch.fetch_add(1, std::memory_order_release);
+            _epoch.notify_one();
+        }
+
+        /// @brief runs tasks of `group` on the calling thread until all of them are finished.
+        /// tasks of other groups are left alone, since they may work on the same per-slot context as the task which is waiting.
+        /// a thread outside the pool takes one of the external slots for the duration of the wait
+        void wait(task_group &group) {
+            if (CurrentPool == this) {
+                waitOn(group, CurrentSlot);
+                return;
+            }
+
+            const size_t external = acquireExternalSlot();
+            if (external == SlotNull) {
+                waitOn(group, SlotNull);
+                return;
+            }
+
+            const thread_pool *const prevPool = CurrentPool;
+            const size_t prevSlot             = CurrentSlot;
+            CurrentPool                       = this;
+            CurrentSlot                       = _workerCount + external;
+
+            waitOn(group, CurrentSlot);
+
+            CurrentPool = prevPool;
+            CurrentSlot = prevSlot;
+            _externalSlots.fetch_and(~(static_cast<size_t>(1) << external), std::memory_order_release);
+        }
+
+      private:
+        static void Work(thread_pool *pool, size_t slot) {
+            CurrentPool = pool;
+            CurrentSlot = slot;
+
+            while (true) {
+                // the epoch is loaded before the flag is tested, otherwise an exit between them would leave the worker waiting
+                // on an epoch which never changes again
+                const size_t epoch = pool->_epoch.load(std::memory_order_acquire);
+                if (pool->_exit.load(std::memory_order_acquire))
+                    break;
+                if (!pool->tryRun(slot, nullptr))
+                    pool->_epoch.wait(epoch, std::memory_order_acquire);
+            }
+        }
+
+        /// @param slot is `SlotNull` if the caller may not run tasks
+        void waitOn(task_group &group, size_t slot) {
+            while (true) {
+                const size_t finished = _finished.load(std::memory_order_acquire);
+                if (group.done())
+                    break;
+                if (slot == SlotNull || !tryRun(slot, &group))
+                    _finished.wait(finished, std::memory_order_acquire);
+            }
+        }
+
+        size_t acquireExternalSlot() {
+            size_t taken = _externalSlots.load(std::memory_order_relaxed);
+            while (true) {
+                size_t i = 0;
+                while (i < ExternalSlotCount && (taken >> i & 1))
+                    i++;
+                if (i == ExternalSlotCount)
+                    return SlotNull;
+                if (_externalSlots.compare_exchange_weak(taken, taken | static_cast<size_t>(1) << i, std::memory_order_acquire,
+                                                         std::memory_order_relaxed))
+                    return i;
+            }
+        }
+
+        /// @param group restricts the task taken to the group, any task is taken if it's null
+        bool tryRun(size_t slot, task_group *group) {
+            task t;
+            if (!(slot < _workerCount && tryPop(slot, group, &t)) && !trySteal(slot, group, &t))
+                return false;
+
+            t.invoke(t.storage, slot);
+
+            if (t.group->_pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                _finished.fetch_add(1, std::memory_order_release);
+                _finished.notify_all();
+            }
+            return true;
+        }
+
+        bool tryPop(size_t slot, task_group *group, task *t) {
+            worker &w = _workers[slot];
+
+            std::lock_guard<std::mutex> lock(w.mutex);
+            for (size_t i = w.tasks.size(); i > 0; i--)
+                if (!group || w.tasks[i - 1].group == group) {
+                    Take(w.tasks, i - 1, t);
+                    return true;
+                }
+            return false;
+        }
+
+        bool trySteal(size_t slot, task_group *group, task *t) {
+            for (size_t i = 1; i <= _workerCount; i++) {
+                worker &w = _workers[(slot + i) % _workerCount];
+
+                std::lock_guard<std::mutex> lock(w.mutex);
+                for (size_t j = 0; j < w.tasks.size(); j++)
+                    if (!group || w.tasks[j].group == group) {
+                        Take(w.tasks, j, t);
+                        return true;
+                    }
+            }
+            return false;
+        }
+
+        /// @brief removes the i-th task, shifting whichever side of the deque is shorter
+        static void Take(circular_list<task> &tasks, size_t i, task *t) {
+            *t = tasks[i];
+            if (i < tasks.size() / 2) {
+                for (size_t j = i; j > 0; j--)
+                    tasks[j] = tasks[j - 1];
+                tasks.pop_front();
+            }
+            else {
+                for (size_t j = i + 1; j < tasks.size(); j++)
+                    tasks[j - 1] = tasks[j];
+                tasks.pop_back();
+            }
+        }
+    };
+}  // namespace igi
@@ -2,6 +2,7 @@
 
 #include "igientity/transform_base.h"
 #include "igigeometry/ray.h"
+#include "igigeometry/ray_packet.h"
 #include "igimath/const.h"
 
 namespace igi {
@@ -43,6 +44,41 @@ namespace igi {
             return r;
         }
 
+        /// @brief generates rays of a packet at once, whose endpoints are transformed over lanes as `getRay` does
+        /// @param n number of rays, the rest lanes are left inactive
+        void getRays(const vec2f *uvs, size_t n, ray_packet *res) const {
+            using packed_t = ray_packet::packed_t;
+
+            igiassert(n <= ray_packet::Size);
+
+            alignas(32) float us[ray_packet::Size] = {}, vs[ray_packet::Size] = {};
+            for (size_t lane = 0; lane < n; lane++) {
+                us[lane] = static_cast<float>(uvs[lane][0]);
+                vs[lane] = static_cast<float>(uvs[lane][1]);
+            }
+
+            const packed_t u = packed_t::Load(us), v = packed_t::Load(vs);
+            auto row = [&](size_t r, float z) {
+                return packed_t(_v2w.get(r, 0)) * u + packed_t(_v2w.get(r, 1)) * v
+                       + packed_t(_v2w.get(r, 2) * z + _v2w.get(r, 3));
+            };
+
+            alignas(32) float points[2][3][ray_packet::Size];
+            for (size_t z = 0; z < 2; z++) {
+                const packed_t w = row(3, static_cast<float>(z));
+                for (size_t i = 0; i < 3; i++)
+                    (row(i, static_cast<float>(z)) * w).store(points[z][i]);
+            }
+
+            for (size_t lane = 0; lane < n; lane++) {
+                ray &r = (*res)[lane];
+                r.reset(vec3f(points[0][0][lane], points[0][1][lane], points[0][2][lane]),
+                        vec3f(points[1][0][lane], points[1][1][lane], points[1][2][lane]));
+                r.normalizeDirection();
+            }
+            res->prepare(n);
+        }
+
         single getNear() const { return _near; }
 
         single getFar() const { return _far; }
@@ -4,8 +4,11 @@
 #include "igiacceleration/mem_arena.h"
 
 namespace igi {
+    /// @brief `thread_temp` allocates from an arena of the calling thread, which is lock-free and is reclaimed at once
+    /// by `context::ResetThreadTemp`, other usages allocate from arenas shared by all threads
     enum class allocate_usage : size_t { persistent,
                                          temp,
+                                         thread_temp,
                                          max };
 
     class context {
@@ -20,35 +23,68 @@ namespace igi {
             mem_arena MemoryArena;
             allocator_t Allocator;
 
-            allocator_wrapper(allocator_t *externalAllocator) {
-                if (externalAllocator)
-                    new (&Allocator) allocator_t(*externalAllocator);
-                else {
-                    new (&MemoryArena) mem_arena();
-                    new (&Allocator) allocator_t(&MemoryArena);
-                }
-            }
+            // `MemoryArena` is declared first, thus it's constructed before the allocator refers to it
+            allocator_wrapper(allocator_t *externalAllocator)
+                : Allocator(externalAllocator ? *externalAllocator : allocator_t(&MemoryArena)) { }
         };
 
+        // external allocators are ignored by `thread_temp`, since they're hardly thread-local
+        template <allocate_usage Usage>
+        static allocator_wrapper &GetWrapper() {
+            if constexpr (Usage == allocate_usage::thread_temp) {
+                thread_local allocator_wrapper Allocator { nullptr };
+
+                return Allocator;
+            }
+            else {
+                static allocator_wrapper Allocator { Usage == allocate_usage::persistent ? ExternalAllocator
+                                                     : Usage == allocate_usage::temp     ? ExternalTempAllocator
+                                                                                         : nullptr };
+
+                return Allocator;
+            }
+        }
+
       public:
         static inline allocator_t *ExternalAllocator = nullptr;
 
         static inline allocator_t *ExternalTempAllocator = nullptr;
 
+        /// @brief the allocator of `thread_temp` is of the calling thread, which is not expected to be passed to other threads
         template <allocate_usage Usage = allocate_usage::persistent>
         static allocator_t &GetAllocator() {
-            static allocator_wrapper Allocator { Usage == allocate_usage::persistent ? ExternalAllocator
-                                                 : Usage == allocate_usage::temp     ? ExternalTempAllocator
-                                                                                     : nullptr };
-
-            return Allocator.Allocator;
+            return GetWrapper<Usage>().Allocator;
         }
 
         template <typename T, allocate_usage Usage = allocate_usage::persistent>
         static allocator_generic_t<T> &GetTypedAllocator() {
-            static allocator_generic_t<T> Allocator { GetAllocator<Usage>() };
+            if constexpr (Usage == allocate_usage::thread_temp) {
+                thread_local allocator_generic_t<T> Allocator { GetAllocator<Usage>() };
+
+                return Allocator;
+            }
+            else {
+                static allocator_generic_t<T> Allocator { GetAllocator<Usage>() };
+
+                return Allocator;
+            }
+        }
+
+        /// @brief reclaims everything allocated by `thread_temp` on the calling thread, which is expected between tasks or tiles
+        /// once nothing allocated by it is alive. storage is kept for later allocations, thus no heap call is made once warmed up
+        static void ResetThreadTemp() {
+            GetWrapper<allocate_usage::thread_temp>().MemoryArena.reset();
+        }
+
+        /// @brief reclaims allocations of `Usage` made within the lifetime of the scope once it's destroyed,
+        /// none of which is expected to outlive it, including storage grown by containers created before it.
+        /// scopes of shared usages are expected to be nested on one thread, and do nothing over external allocators
+        template <allocate_usage Usage = allocate_usage::temp>
+        static mem_arena::scope GetScope() {
+            static_assert(Usage != allocate_usage::persistent, "persistent allocations are expected to live until exit");
 
-            return Allocator;
+            allocator_wrapper &wrapper = GetWrapper<Usage>();
+            return mem_arena::scope(wrapper.Allocator.resource() == &wrapper.MemoryArena ? &wrapper.MemoryArena : nullptr);
         }
 
         template <typename T, allocate_usage Usage = allocate_usage::persistent>
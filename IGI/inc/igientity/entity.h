@@ -47,7 +47,40 @@ namespace igi {
         }
 
         bool tryHit(ray &r, interaction *res) const {
-            if (!_surf->tryHit(r, getTransform(), &res->surface))
+            return tryHit(r, res, _surf);
+        }
+
+        /// @brief counterpart of `isHit` without virtual call, for surface known to be exactly of type `T`
+        /// @param surf surface of the entity, or `ISurface` for any type
+        /// @param baked data of the surface baked in world space, which is passed in place of the transform if any
+        template <typename T, typename... TBaked>
+        bool isHit(const ray &r, const T *surf, const TBaked &...baked) const {
+            igiassert(surf == _surf);
+
+            if constexpr (std::is_same_v<T, ISurface>)
+                return surf->isHit(r, getTransform());
+            else if constexpr (sizeof...(TBaked) > 0)
+                return surf->T::isHit(r, baked...);
+            else
+                return surf->T::isHit(r, getTransform());
+        }
+
+        /// @brief counterpart of `tryHit` without virtual call, for surface known to be exactly of type `T`
+        /// @param surf surface of the entity, or `ISurface` for any type
+        /// @param baked data of the surface baked in world space, which is passed in place of the transform if any
+        template <typename T, typename... TBaked>
+        bool tryHit(ray &r, interaction *res, const T *surf, const TBaked &...baked) const {
+            igiassert(surf == _surf);
+
+            bool hit;
+            if constexpr (std::is_same_v<T, ISurface>)
+                hit = surf->tryHit(r, getTransform(), &res->surface);
+            else if constexpr (sizeof...(TBaked) > 0)
+                hit = surf->T::tryHit(r, baked..., &res->surface);
+            else
+                hit = surf->T::tryHit(r, getTransform(), &res->surface);
+
+            if (!hit)
                 return false;
 
             res->entityId = interaction::EntityToID(this);
@@ -55,6 +88,26 @@ namespace igi {
             return true;
         }
 
+        /// @brief counterpart of `tryHit` for built-in surfaces with baked data, which records the hit only.
+        /// the interaction is filled by `computeInteraction` once the hit is known to be the closest
+        template <typename T, typename... TBaked>
+        bool tryHit(ray &r, surface_hit *hit, const T *surf, const TBaked &...baked) const {
+            igiassert(surf == _surf);
+            static_assert(sizeof...(TBaked) > 0);
+
+            return surf->T::tryHit(r, baked..., hit);
+        }
+
+        template <typename T, typename... TBaked>
+        void computeInteraction(const ray &r, const surface_hit &hit, interaction *res, const T *surf, const TBaked &...baked) const {
+            igiassert(surf == _surf);
+
+            surf->T::computeInteraction(r, baked..., hit, &res->surface);
+
+            res->entityId = interaction::EntityToID(this);
+            res->material = _mat;
+        }
+
         bound_t getBound() const {
             bound_t res = _surf->getBound(getTransform());
             igiassert(!res.isSingular());
@@ -3,6 +3,8 @@
 #include "igigeometry/bound.h"
 #include "igigeometry/ray.h"
 #include "igigeometry/surface_interaction.h"
+#include "igimath/compact_affine.h"
+#include "igiutilities/igiassert.h"
 #include "igiutilities/serialize.h"
 
 namespace igi {
@@ -13,9 +15,34 @@ namespace igi {
 
         virtual bound_t getBound(const transform &trans) const = 0;
 
+        /// @brief bound of the part of the surface within `box`, which is used to shrink references cut by spatial splits.
+        /// by default it's the common part of the bound and `box`, surfaces which can be clipped exactly override it
+        /// @return conservative bound within `box`, or a singular bound if nothing is left
+        virtual bound_t getClippedBound(const transform &trans, const bound_t &box) const {
+            return getBound(trans).intersect(box);
+        }
+
         virtual bool isHit(const ray &r, const transform &o2w) const                      = 0;
         virtual bool tryHit(ray &r, const transform &o2w, surface_interaction *res) const = 0;
 
+        /// @brief whether `sample` is implemented, only such surfaces of emissive materials are sampled as lights
+        virtual bool canSample() const {
+            return false;
+        }
+
+        /// @brief samples a point uniformly over the surface in object space, which is then transformed to world space.
+        /// surfaces which override it are expected to override `canSample` as well
+        /// @param u uniformly distributed in [0, 1)^2
+        virtual void sample(const transform &o2w, const vec2f &u, surface_sample *res) const {
+            igiassert(false, "surface can't be sampled, see `canSample`");
+            res->pdf = 0_sg;
+        }
+
+        /// @brief brings an interaction left in object space to world space, which is deferred until the closest hit is known
+        static void ToWorldSpace(const transform &o2w, surface_interaction *res) {
+            surface_helper::ResToWorldSpace(o2w, res);
+        }
+
       protected:
         class surface_helper {
           public:
@@ -26,6 +53,13 @@ namespace igi {
                 return r;
             }
 
+            /// @brief ratio of area in world space to area in object space, around a point whose normal is `n`
+            static single GetAreaScale(const transform &o2w, const vec3f &n) {
+                const vec3f t0 = Cross(n, Abs(n[0]) < .9_sg ? vec3f(1_sg, 0_sg, 0_sg) : vec3f(0_sg, 1_sg, 0_sg)).normalized();
+                const vec3f t1 = Cross(n, t0);
+                return Cross(o2w.mulVec(t0), o2w.mulVec(t1)).magnitude();
+            }
+
             static void ResToWorldSpace(const transform &o2w, surface_interaction *res) {
                 res->position = o2w.mulPos(res->position);
                 res->normal   = o2w.mulNormal(res->normal).normalized();
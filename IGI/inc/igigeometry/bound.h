@@ -4,10 +4,27 @@
 #include "igimath/vec.h"
 
 namespace igi {
+    /// @brief converts a coordinate of bounds to float, which is rounded outwards if `single` is double,
+    /// so that bounds tested in float, e.g., by wide nodes and ray packets, never shrink
+    /// @tparam Up whether the coordinate is of the upper side
+    template <bool Up>
+    inline float ToFloatBound(single x) {
+        const float f = static_cast<float>(x);
+        if constexpr (std::is_same_v<single, float>)
+            return f;
+        else if constexpr (Up)
+            return f < x ? IncreaseBit(f) : f;
+        else
+            return f > x ? DecreaseBit(f) : f;
+    }
+
     class aabb {
         vec3f _min, _max;
 
       public:
+        /// @brief 1 + 2 gamma(3), by which the far distance to slabs is scaled to bound rounding errors, see pbrt 3.9.2
+        static constexpr single RobustFactor = 1_sg + 2_sg * (3_sg * SingleEpsilon * .5_sg) / (1_sg - 3_sg * SingleEpsilon * .5_sg);
+
         aabb() = default;
         constexpr aabb(const vec3f &half) : _min(-half), _max(half) { }
         constexpr aabb(const vec3f &min, const vec3f &max) : _min(min), _max(max) { }
@@ -67,6 +84,12 @@ namespace igi {
                         vec3f([&](size_t i, size_t) { return IncreaseBit(_max[i]); }));
         }
 
+        /// @brief common part of two bounds, which is singular if they don't overlap
+        constexpr aabb intersect(const aabb &b) const {
+            return aabb(vec3f([&](size_t i, size_t) { return _min[i] < b._min[i] ? b._min[i] : _min[i]; }),
+                        vec3f([&](size_t i, size_t) { return b._max[i] < _max[i] ? b._max[i] : _max[i]; }));
+        }
+
         constexpr vec3f getDiagonal() const {
             return _max - _min;
         }
@@ -98,22 +121,38 @@ namespace igi {
 
         aabb transform(const igi::transform &trans) const {
             aabb res = NegInf();
-            for (size_t i = 0; i < 7; i++)
+            for (size_t i = 0; i < 8; i++)
                 res.extend(trans.mulPos(operator[](i)));
             return res;
         }
 
         bool isHit(const ray &r) const {
-            vec3f e = r.getEndpoint();
-            vec3f o = r.getOrigin();
+            single tEntry;
+            return isHit(r, &tEntry);
+        }
+
+        /// @brief slab test, which is conservative under rounding errors
+        /// @param tEntry distance at which the ray enters the box, no less than the minimum distance of the ray
+        bool isHit(const ray &r, single *tEntry) const {
+            const vec3f &o    = r.getOrigin();
+            const vec3f &invD = r.getInvDirection();
 
-            single min, max;
+            single t0 = r.getTMin(), t1 = r.getT();
             for (size_t i = 0; i < 3; i++) {
-                min = e[i] < o[i] ? e[i] : o[i];
-                max = e[i] < o[i] ? o[i] : e[i];
-                if (!Overlapcf(min, max, _min[i], _max[i]))
+                const bool neg     = r.isNegDirection(i);
+                const single tNear = ((neg ? _max[i] : _min[i]) - o[i]) * invD[i];
+                const single tFar  = ((neg ? _min[i] : _max[i]) - o[i]) * invD[i] * RobustFactor;
+
+                // nan is produced if the origin lies on a slab parallel to the ray, in which case the slab is ignored
+                if (t0 < tNear)
+                    t0 = tNear;
+                if (tFar < t1)
+                    t1 = tFar;
+                if (t1 < t0)
                     return false;
             }
+
+            *tEntry = t0;
             return true;
         }
 
@@ -19,6 +19,12 @@ namespace igi {
         // -d.x / d.z, d.y / d.z
         vec2f _shear;
 
+        // reciprocal of direction and signs of it, for slab tests.
+        // signs are taken from the reciprocal so that they agree on negative zero
+        vec3f _invD;
+
+        unsigned _negD;
+
       public:
         ray()            = default;
         ray(const ray &) = default;
@@ -30,7 +36,9 @@ namespace igi {
               _permY(_permZ ? 3 - _permZ : 2),
               _permX(_permZ == 2 ? 0 : _permZ + 1),
               _invDZ(1_sg / _d[_permZ]),
-              _shear(-d[_permX] * _invDZ, -d[_permY] * _invDZ) { }
+              _shear(-d[_permX] * _invDZ, -d[_permY] * _invDZ),
+              _invD(1_sg / d[0], 1_sg / d[1], 1_sg / d[2]),
+              _negD((_invD[0] < 0_sg) | (_invD[1] < 0_sg) << 1 | (_invD[2] < 0_sg) << 2) { }
 
         constexpr ray &operator=(const ray &) = default;
         constexpr ray &operator=(ray &&) = default;
@@ -53,6 +61,42 @@ namespace igi {
             new (this) ray(_o, d, _t);
         }
 
+        constexpr const vec3f &getInvDirection() const {
+            return _invD;
+        }
+
+        /// @brief the i-th bit is set if the i-th component of direction is negative
+        constexpr unsigned getNegDirection() const {
+            return _negD;
+        }
+
+        constexpr bool isNegDirection(size_t dim) const {
+            return _negD & (1u << dim);
+        }
+
+        /// @brief dimensions permuted to x, y and z of ray space, the last of which is the major one of direction
+        constexpr int getPermX() const {
+            return _permX;
+        }
+
+        constexpr int getPermY() const {
+            return _permY;
+        }
+
+        constexpr int getPermZ() const {
+            return _permZ;
+        }
+
+        /// @brief shear to ray space applied to x and y, see `toRaySpace`
+        constexpr const vec2f &getShear() const {
+            return _shear;
+        }
+
+        /// @brief scale to ray space applied to z, see `toRaySpace`
+        constexpr single getInvDirectionZ() const {
+            return _invDZ;
+        }
+
         constexpr vec3f getEndpoint() const {
             return cast(_t);
         }
@@ -87,6 +131,8 @@ namespace igi {
             single m = _d.magnitude();
             _t *= m;
             _d = _d / m;
+            _invDZ *= m;
+            _invD = _invD * m;
         }
 
         constexpr vec3f cast(single t) const {
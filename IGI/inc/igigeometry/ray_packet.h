@@ -0,0 +1,91 @@
+﻿#pragma once
+
+#include <bit>
+#include "igigeometry/bound.h"
+#include "igigeometry/ray.h"
+#include "igimath/simd.h"
+
+namespace igi {
+    /// @brief rays traced together through the aggregate, which is efficient for coherent rays like primary ones.
+    /// origins, reciprocal directions and distances are mirrored in SoA form for box tests of all lanes at once
+    class ray_packet {
+      public:
+        static constexpr size_t Size = 8;
+
+        using packed_t = packed_single<Size>;
+
+      private:
+        ray _rays[Size];
+
+        alignas(32) float _o[3][Size];
+        alignas(32) float _invD[3][Size];
+        alignas(32) float _t[Size];
+
+        unsigned _active;
+
+      public:
+        ray_packet() : _active(0) { }
+
+        ray &operator[](size_t lane) {
+            return _rays[lane];
+        }
+
+        const ray &operator[](size_t lane) const {
+            return _rays[lane];
+        }
+
+        /// @brief the i-th bit is set if the i-th lane is in use
+        unsigned getActiveMask() const {
+            return _active;
+        }
+
+        /// @brief mirrors rays into SoA form, which is expected once rays are set
+        /// @param n number of lanes in use, which are the first `n` ones
+        void prepare(size_t n) {
+            igiassert(n <= Size);
+
+            _active = (1u << n) - 1u;
+            for (size_t lane = 0; lane < Size; lane++) {
+                // unused lanes are made to miss everything
+                const bool active = lane < n;
+                for (size_t i = 0; i < 3; i++) {
+                    _o[i][lane]    = active ? static_cast<float>(_rays[lane].getOrigin()[i]) : 0.f;
+                    _invD[i][lane] = active ? static_cast<float>(_rays[lane].getInvDirection()[i]) : 1.f;
+                }
+                _t[lane] = active ? static_cast<float>(_rays[lane].getT()) : -1.f;
+            }
+        }
+
+        /// @brief to be called once the distance of a ray is shortened by a hit, so that boxes behind it are culled
+        void updateT(size_t lane) {
+            _t[lane] = static_cast<float>(_rays[lane].getT());
+        }
+
+        /// @brief counterpart of `aabb::isHit` over lanes, the i-th bit is set if the i-th ray hits the box
+        /// @param mask lanes to be tested
+        /// @param tEntry distances at which rays enter the box
+        unsigned getHitMask(const bound_t &b, unsigned mask, packed_t *tEntry) const {
+            const packed_t robust(static_cast<float>(bound_t::RobustFactor));
+
+            packed_t t0(0.f);
+            packed_t t1 = packed_t::Load(_t);
+            for (size_t i = 0; i < 3; i++) {
+                const packed_t oi    = packed_t::Load(_o[i]);
+                const packed_t invDi = packed_t::Load(_invD[i]);
+                const packed_t lo(ToFloatBound<false>(b.getMin(i)));
+                const packed_t hi(ToFloatBound<true>(b.getMax(i)));
+
+                // slabs are swapped by the sign bit of reciprocal direction, which agrees with `ray::isNegDirection`
+                const packed_t tNear = (Blend(lo, hi, invDi) - oi) * invDi;
+                const packed_t tFar  = (Blend(hi, lo, invDi) - oi) * invDi * robust;
+
+                // nan distances are ignored as `aabb::isHit` does, since min and max return the second operand then
+                t0 = Max(tNear, t0);
+                t1 = Min(tFar, t1);
+            }
+
+            *tEntry = t0;
+            return (t0 <= t1).getMask() & mask;
+        }
+    };
+}  // namespace igi
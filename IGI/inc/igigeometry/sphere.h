@@ -27,6 +27,20 @@ namespace igi {
 
         bool isHit(const ray &r, const transform &trans) const override;
         bool tryHit(ray &r, const transform &trans, surface_interaction *res) const override;
+
+        /// @brief counterparts of `isHit` and `tryHit` with the world-to-object transform baked,
+        /// the interaction is left in object space, see `ISurface::ToWorldSpace`
+        bool isHit(const ray &r, const compact_affine &w2o) const;
+        bool tryHit(ray &r, const compact_affine &w2o, surface_interaction *res) const;
+
+        /// @brief records the point hit in object space only, see `computeInteraction`
+        bool tryHit(ray &r, const compact_affine &w2o, surface_hit *hit) const;
+        /// @brief fills the interaction in object space from a hit recorded by `tryHit`
+        void computeInteraction(const ray &r, const compact_affine &w2o, const surface_hit &hit, surface_interaction *res) const;
+
+        bool canSample() const override { return true; }
+
+        void sample(const transform &trans, const vec2f &u, surface_sample *res) const override;
     };
 
 }  // namespace igi
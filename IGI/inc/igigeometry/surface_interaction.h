@@ -24,4 +24,21 @@ namespace igi {
             return mat3x3f(dpdu, dpdv, normal);
         }
     };
+
+    /// @brief minimal record of a hit, from which `surface_interaction` is computed once the closest hit is known.
+    /// the distance is kept by the ray
+    struct surface_hit {
+        /// @brief barycentric coordinates for triangles, or the point hit in object space for analytic surfaces
+        vec3f coords;
+    };
+
+    /// @brief point sampled on a surface
+    struct surface_sample {
+        vec3f position;
+
+        vec3f normal;
+
+        /// @brief probability density with respect to area in world space
+        single pdf;
+    };
 }  // namespace igi
@@ -1,4 +1,6 @@
-﻿#include <iterator>
+﻿#pragma once
+
+#include <iterator>
 #include <memory_resource>
 #include "igigeometry/ISurface.h"
 #include "igiutilities/igiassert.h"
@@ -6,6 +8,11 @@
 namespace igi {
     class triangle_mesh;
 
+    /// @brief vertices of a triangle transformed to world space, which are baked once its transform is final
+    struct triangle_vertices {
+        vec3f positions[3];
+    };
+
     /// <summary>
     /// <para> 1. triangles must be constructed by triangle_mesh </para>
     /// <para> 2. vertices are in anti-clockwise order </para>
@@ -26,9 +33,27 @@ namespace igi {
 
         bound_t getBound(const transform &trans) const override;
 
+        /// @brief the triangle is clipped by planes of `box` one by one, the bound of the polygon left is returned
+        bound_t getClippedBound(const transform &trans, const bound_t &box) const override;
+
         bool isHit(const ray &r, const transform &) const override;
         bool tryHit(ray &r, const transform &, surface_interaction *res) const override;
 
+        /// @brief counterparts of `isHit` and `tryHit` without transforming vertices
+        bool isHit(const ray &r, const triangle_vertices &world) const;
+        bool tryHit(ray &r, const triangle_vertices &world, surface_interaction *res) const;
+
+        /// @brief records barycentric coordinates of the hit only, see `computeInteraction`
+        bool tryHit(ray &r, const triangle_vertices &world, surface_hit *hit) const;
+        /// @brief fills the interaction in world space from a hit recorded by `tryHit`
+        void computeInteraction(const ray &r, const triangle_vertices &world, const surface_hit &hit, surface_interaction *res) const;
+
+        triangle_vertices getVertices(const transform &trans) const;
+
+        bool canSample() const override { return true; }
+
+        void sample(const transform &trans, const vec2f &u, surface_sample *res) const override;
+
         decltype(auto) getPos(size_t index) const;
         decltype(auto) getUV(size_t index) const;
 
@@ -102,11 +127,11 @@ namespace igi {
 
             switch (topology) {
                 case igi::triangle_topology::list:
-                    for (triangle::index_t i = 0; i < _positions.size(); i += 3)
+                    for (triangle::index_t i = 0; i + 2 < _positions.size(); i += 3)
                         _triangles.emplace_back(i, i + 1, i + 2, this);
                     break;
                 case igi::triangle_topology::fan:
-                    for (triangle::index_t i = 1; i < _positions.size(); i++)
+                    for (triangle::index_t i = 1; i + 1 < _positions.size(); i++)
                         _triangles.emplace_back(0, i, i + 1, this);
                     break;
             }
@@ -227,6 +252,10 @@ namespace igi {
         return std::forward_as_tuple(getPos(index), getPos((index + 1) % 3));
     }
 
+    inline triangle_vertices triangle::getVertices(const transform &trans) const {
+        return triangle_vertices { { trans.mulPos(getPos(0)), trans.mulPos(getPos(1)), trans.mulPos(getPos(2)) } };
+    }
+
     inline single triangle::getArea() const {
         const auto &[a, b, c] = getPos();
         return Cross(b - a, c - a).magnitude();
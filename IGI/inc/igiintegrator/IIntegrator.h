@@ -14,6 +14,13 @@ namespace igi {
             : pcg(GetSeed()), itrtmp(context::GetTypedAllocator<typename itr_stack_t::value_type>()) {
         }
 
+        /// @brief brings the context back to the state of a newly constructed one, while keeping allocated storage
+        void reset() {
+            pcg.seed(GetSeed());
+            while (!itrtmp.empty())
+                itrtmp.pop();
+        }
+
       private:
         static uint64_t GetSeed() {
 #ifdef NDEBUG
@@ -29,5 +36,20 @@ namespace igi {
         META_BE_RT(IIntegrator)
 
         virtual color3 integrate(const scene &scene, ray &r, integrator_context &context) const = 0;
+
+        /// @brief whether `integrateHit` is implemented, only such integrators are handed primary rays traced as packets,
+        /// others are given the rays one by one through `integrate`, so that no ray is traced twice
+        virtual bool canIntegrateHit() const {
+            return false;
+        }
+
+        /// @brief radiance along a ray whose closest hit is already found, e.g., by packet traversal of primary rays.
+        /// integrators which override it are expected to override `canIntegrateHit` as well
+        /// @param r clipped to the distance to `hit` if anything is hit
+        /// @param hit interaction of the ray, or nullptr if nothing is hit
+        virtual color3 integrateHit(const scene &scene, ray &r, const interaction *hit, integrator_context &context) const {
+            igiassert(false, "integrator can't carry on from hits, see `canIntegrateHit`");
+            return palette::black;
+        }
     };
 }  // namespace igi
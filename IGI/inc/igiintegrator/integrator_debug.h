@@ -12,7 +12,7 @@ namespace igi {
                                                 material_lum = 6 };
 
     class integrator_debug : public IIntegrator {
-        using debug_func_t = color3 (*)(ray &r, interaction &i);
+        using debug_func_t = color3 (*)(ray &r, const interaction &i);
 
         debug_func_t _debug;
 
@@ -61,10 +61,13 @@ namespace igi {
             const aggregate &agg = scene.getAggregate();
 
             interaction iact;
-            if (!agg.tryHit(r, &iact, context.itrtmp))
-                return palette::black;
+            return integrateHit(scene, r, agg.tryHit(r, &iact, context.itrtmp) ? &iact : nullptr, context);
+        }
+
+        bool canIntegrateHit() const override { return true; }
 
-            return _debug(r, iact);
+        color3 integrateHit(const scene &scene, ray &r, const interaction *hit, integrator_context &context) const override {
+            return hit ? _debug(r, *hit) : palette::black;
         }
 
       private:
@@ -76,31 +79,31 @@ namespace igi {
             return color3(Abs(v[0]), Abs(v[1]), Abs(v[2]));
         }
 
-        static color3 debugpostion(ray &r, interaction &i) {
+        static color3 debugpostion(ray &r, const interaction &i) {
             return vecToCol(i.surface.position);
         }
 
-        static color3 debugnormal(ray &r, interaction &i) {
+        static color3 debugnormal(ray &r, const interaction &i) {
             return vecToCol(i.surface.normal);
         }
 
-        static color3 debuguv(ray &r, interaction &i) {
+        static color3 debuguv(ray &r, const interaction &i) {
             return vecToCol(i.surface.uv);
         }
 
-        static color3 debugdpdu(ray &r, interaction &i) {
+        static color3 debugdpdu(ray &r, const interaction &i) {
             return vecToCol(i.surface.dpdu);
         }
 
-        static color3 debugdpdv(ray &r, interaction &i) {
+        static color3 debugdpdv(ray &r, const interaction &i) {
             return vecToCol(i.surface.dpdv);
         }
 
-        static color3 debugdepth(ray &r, interaction &i) {
+        static color3 debugdepth(ray &r, const interaction &i) {
             return color3::Grey(std::exp(-r.getT()));
         }
 
-        static color3 debugmaterial_lum(ray &r, interaction &i) {
+        static color3 debugmaterial_lum(ray &r, const interaction &i) {
             return i.material->getLuminance();
         }
     };
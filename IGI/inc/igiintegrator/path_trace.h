@@ -9,26 +9,73 @@ namespace igi {
 
         const size_t _split;
 
+        // samples a light at each scattering, instead of relying on scattered rays to hit lights
+        const bool _nee;
+
       public:
         META_BE_RT(path_trace, ser_pmr_name_a("path trace"), deser_pmr_func_a<IIntegrator>([](const serializer_t &ser) {
                        IGI_SERIALIZE_OPTIONAL(size_t, depth, 4, ser);
                        IGI_SERIALIZE_OPTIONAL(size_t, split, 1, ser);
+                       IGI_SERIALIZE_OPTIONAL(bool, nee, false, ser);
 
-                       IIntegrator *pt = context::New<path_trace>(depth, split);
+                       IIntegrator *pt = context::New<path_trace>(depth, split, nee);
                        return pt;
                    }))
 
-        path_trace(size_t depth = 4, size_t split = 1)
-            : _depth(depth), _split(split < 1 ? 1 : split) { }
+        path_trace(size_t depth = 4, size_t split = 1, bool nee = false)
+            : _depth(depth), _split(split < 1 ? 1 : split), _nee(nee) { }
 
         color3 integrate(const scene &scene, ray &r, integrator_context &context) const override {
             interaction i;
-            return scene.getAggregate().tryHit(r, &i, context.itrtmp)
-                       ? integrate_impl(scene, r.getDirection(), i, _depth, context)
-                       : scene.getBackground();
+            return integrateHit(scene, r, scene.getAggregate().tryHit(r, &i, context.itrtmp) ? &i : nullptr, context);
+        }
+
+        bool canIntegrateHit() const override { return true; }
+
+        color3 integrateHit(const scene &scene, ray &r, const interaction *hit, integrator_context &context) const override {
+            if (!hit)
+                return scene.getBackground();
+
+            if (!_nee)
+                return integrate_impl(scene, r.getDirection(), *hit, _depth, true, context);
+
+            // the light sampled at the last vertex makes the last bounce, so one fewer is scattered than without it
+            return _depth ? integrate_impl(scene, r.getDirection(), *hit, _depth - 1, true, context)
+                          : GetEmission(r.getDirection(), *hit);
         }
 
       private:
-        color3 integrate_impl(const scene &scene, const vec3f &o, const interaction &interaction, size_t depth, integrator_context &context) const;
+        /// @brief with NEE, contributions whose throughput is below it are terminated by russian roulette,
+        /// which survive with probability proportional to the throughput and are weighted up accordingly
+        static constexpr single RouletteThreshold = .05_sg;
+
+        /// @brief bound of rounding errors of intersection points relative to their magnitude, roughly gamma(7) of pbrt 3.9
+        static constexpr single OriginErrorScale = 4_sg * SingleEpsilon;
+
+        /// @brief bound of the rounding error of a point on a surface, which has an absolute floor for points near the origin
+        static single GetOriginError(const vec3f &p) {
+            return (p.l1norm() + 1_sg) * OriginErrorScale;
+        }
+
+        /// @brief point `p` on a surface of normal `n`, which is pushed along the normal to the side of `d`
+        /// beyond its rounding error, so that rays leaving or reaching it aren't occluded by the surface
+        static vec3f OffsetOrigin(const vec3f &p, const vec3f &n, const vec3f &d);
+
+        static color3 GetEmission(const vec3f &o, const interaction &interaction) {
+            return interaction.material->getLuminance() * -Dot(o, interaction.surface.normal);
+        }
+
+        /// @brief whether the entity interacted with is among lights of the scene, whose luminance is then accounted for
+        /// by sampling it as a light rather than by hitting it
+        static bool IsSampledLight(const interaction &interaction) {
+            return interaction.material->getLuminance().brightness() > 0_col
+                   && interaction::IDToEntity(interaction.entityId)->getSurface().canSample();
+        }
+
+        /// @param depth bounces left after the interaction, at depth 0 only the light is sampled
+        /// @param emitted whether luminance of the interaction is accounted for, which is not the case if it's already sampled as a light
+        color3 integrate_impl(const scene &scene, const vec3f &o, const interaction &interaction, size_t depth, bool emitted, integrator_context &context) const;
+
+        color3 sampleLight(const scene &scene, const vec3f &o, const interaction &interaction, integrator_context &context) const;
     };
 }  // namespace igi
@@ -21,5 +21,9 @@ namespace igi {
         static entity_id_t EntityToID(const entity *e) {
             return reinterpret_cast<entity_id_t>(e);
         }
+
+        static const entity *IDToEntity(entity_id_t id) {
+            return reinterpret_cast<const entity *>(id);
+        }
     };
 }  // namespace igi
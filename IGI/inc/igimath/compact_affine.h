@@ -0,0 +1,73 @@
+﻿#pragma once
+
+#include "igimath/mat4x4f.h"
+#include "igimath/vec.h"
+
+namespace igi {
+    /// @brief the upper 3x4 part of an affine matrix, which is classified once so that
+    /// translation-only and uniformly scaled matrices skip the full product
+    class compact_affine {
+      public:
+        enum class affine_kind : uint8_t { translation = 0,
+                                           uniform_scale = 1,
+                                           general = 2 };
+
+      private:
+        single _m[3][4];
+
+        affine_kind _kind;
+
+      public:
+        compact_affine() : compact_affine(mat4x4f::Identity()) { }
+
+        explicit compact_affine(const mat4x4f &m) {
+            for (size_t r = 0; r < 3; r++)
+                for (size_t c = 0; c < 4; c++)
+                    _m[r][c] = m.get(r, c);
+
+            bool diagonal = true;
+            for (size_t r = 0; r < 3; r++)
+                for (size_t c = 0; c < 3; c++)
+                    if (r != c && _m[r][c] != 0_sg)
+                        diagonal = false;
+
+            const bool uniform = diagonal && _m[0][0] == _m[1][1] && _m[1][1] == _m[2][2];
+            _kind              = !uniform ? affine_kind::general : _m[0][0] == 1_sg ? affine_kind::translation
+                                                                                     : affine_kind::uniform_scale;
+        }
+
+        affine_kind getKind() const {
+            return _kind;
+        }
+
+        vec3f mulPos(const vec3f &p) const {
+            const vec3f t(_m[0][3], _m[1][3], _m[2][3]);
+            switch (_kind) {
+                case affine_kind::translation:
+                    return p + t;
+                case affine_kind::uniform_scale:
+                    return p * _m[0][0] + t;
+                default:
+                    return mulLinear(p) + t;
+            }
+        }
+
+        vec3f mulVec(const vec3f &v) const {
+            switch (_kind) {
+                case affine_kind::translation:
+                    return v;
+                case affine_kind::uniform_scale:
+                    return v * _m[0][0];
+                default:
+                    return mulLinear(v);
+            }
+        }
+
+      private:
+        vec3f mulLinear(const vec3f &v) const {
+            return vec3f(_m[0][0] * v[0] + _m[0][1] * v[1] + _m[0][2] * v[2],
+                         _m[1][0] * v[0] + _m[1][1] * v[1] + _m[1][2] * v[2],
+                         _m[2][0] * v[0] + _m[2][1] * v[1] + _m[2][2] * v[2]);
+        }
+    };
+}  // namespace igi
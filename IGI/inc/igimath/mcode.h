@@ -20,10 +20,12 @@ namespace igi {
             return _coord;
         }
 
+        /// @brief steps to the next coordinate along z-order curve, i.e., bits of the components are incremented interleavedly
         constexpr mvec &operator++() {
-            for (T &i : _coord)
-                if (++i & 1)
-                    break;
+            for (T bit = 1; bit; bit <<= 1)
+                for (T &i : _coord)
+                    if ((i ^= bit) & bit)
+                        return *this;
             return *this;
         }
 
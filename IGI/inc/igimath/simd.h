@@ -0,0 +1,179 @@
+﻿#pragma once
+
+#include <immintrin.h>
+#include <cstddef>
+#include <cstdint>
+
+namespace igi {
+    template <size_t N>
+    struct packed_traits;
+
+    template <>
+    struct packed_traits<4> {
+        using reg_t = __m128;
+
+        static reg_t Set1(float s) { return _mm_set1_ps(s); }
+
+        static reg_t Load(const float *p) { return _mm_load_ps(p); }
+
+        static reg_t LoadU8(const uint8_t *p) { return _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_loadu_si32(p))); }
+
+        static void Store(float *p, reg_t v) { _mm_store_ps(p, v); }
+
+        static reg_t Add(reg_t l, reg_t r) { return _mm_add_ps(l, r); }
+
+        static reg_t Sub(reg_t l, reg_t r) { return _mm_sub_ps(l, r); }
+
+        static reg_t Mul(reg_t l, reg_t r) { return _mm_mul_ps(l, r); }
+
+        static reg_t Div(reg_t l, reg_t r) { return _mm_div_ps(l, r); }
+
+        static reg_t Min(reg_t l, reg_t r) { return _mm_min_ps(l, r); }
+
+        static reg_t Max(reg_t l, reg_t r) { return _mm_max_ps(l, r); }
+
+        static reg_t And(reg_t l, reg_t r) { return _mm_and_ps(l, r); }
+
+        static reg_t AndNot(reg_t l, reg_t r) { return _mm_andnot_ps(l, r); }
+
+        static reg_t Or(reg_t l, reg_t r) { return _mm_or_ps(l, r); }
+
+        static reg_t Blend(reg_t f, reg_t t, reg_t mask) { return _mm_blendv_ps(f, t, mask); }
+
+        static reg_t CmpLE(reg_t l, reg_t r) { return _mm_cmple_ps(l, r); }
+
+        static reg_t CmpLT(reg_t l, reg_t r) { return _mm_cmplt_ps(l, r); }
+
+        static unsigned MoveMask(reg_t v) { return static_cast<unsigned>(_mm_movemask_ps(v)); }
+    };
+
+    template <>
+    struct packed_traits<8> {
+        using reg_t = __m256;
+
+        static reg_t Set1(float s) { return _mm256_set1_ps(s); }
+
+        static reg_t Load(const float *p) { return _mm256_load_ps(p); }
+
+        static reg_t LoadU8(const uint8_t *p) {
+            const __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p));
+            return _mm256_cvtepi32_ps(_mm256_set_m128i(_mm_cvtepu8_epi32(_mm_srli_si128(v, 4)), _mm_cvtepu8_epi32(v)));
+        }
+
+        static void Store(float *p, reg_t v) { _mm256_store_ps(p, v); }
+
+        static reg_t Add(reg_t l, reg_t r) { return _mm256_add_ps(l, r); }
+
+        static reg_t Sub(reg_t l, reg_t r) { return _mm256_sub_ps(l, r); }
+
+        static reg_t Mul(reg_t l, reg_t r) { return _mm256_mul_ps(l, r); }
+
+        static reg_t Div(reg_t l, reg_t r) { return _mm256_div_ps(l, r); }
+
+        static reg_t Min(reg_t l, reg_t r) { return _mm256_min_ps(l, r); }
+
+        static reg_t Max(reg_t l, reg_t r) { return _mm256_max_ps(l, r); }
+
+        static reg_t And(reg_t l, reg_t r) { return _mm256_and_ps(l, r); }
+
+        static reg_t AndNot(reg_t l, reg_t r) { return _mm256_andnot_ps(l, r); }
+
+        static reg_t Or(reg_t l, reg_t r) { return _mm256_or_ps(l, r); }
+
+        static reg_t Blend(reg_t f, reg_t t, reg_t mask) { return _mm256_blendv_ps(f, t, mask); }
+
+        static reg_t CmpLE(reg_t l, reg_t r) { return _mm256_cmp_ps(l, r, _CMP_LE_OQ); }
+
+        static reg_t CmpLT(reg_t l, reg_t r) { return _mm256_cmp_ps(l, r, _CMP_LT_OQ); }
+
+        static unsigned MoveMask(reg_t v) { return static_cast<unsigned>(_mm256_movemask_ps(v)); }
+    };
+
+    /// @brief N floats in a SSE (N = 4) or AVX (N = 8) register.
+    /// comparisons yield lane masks, which are reduced to bits by `getMask`
+    template <size_t N>
+    class packed_single {
+        using traits_t = packed_traits<N>;
+        using reg_t    = typename traits_t::reg_t;
+
+        reg_t _v;
+
+      public:
+        static constexpr size_t Size = N;
+
+        packed_single() = default;
+
+        packed_single(reg_t v) : _v(v) { }
+
+        explicit packed_single(float s) : _v(traits_t::Set1(s)) { }
+
+        /// @param p is expected to be aligned to the size of the register
+        static packed_single Load(const float *p) {
+            return traits_t::Load(p);
+        }
+
+        /// @brief converts N unsigned bytes to floats, `p` needn't be aligned
+        static packed_single LoadU8(const uint8_t *p) {
+            return traits_t::LoadU8(p);
+        }
+
+        void store(float *p) const {
+            traits_t::Store(p, _v);
+        }
+
+        /// @brief the i-th bit is set if the i-th lane is set
+        unsigned getMask() const {
+            return traits_t::MoveMask(_v);
+        }
+
+        friend packed_single operator+(const packed_single &l, const packed_single &r) {
+            return traits_t::Add(l._v, r._v);
+        }
+
+        friend packed_single operator-(const packed_single &l, const packed_single &r) {
+            return traits_t::Sub(l._v, r._v);
+        }
+
+        friend packed_single operator*(const packed_single &l, const packed_single &r) {
+            return traits_t::Mul(l._v, r._v);
+        }
+
+        friend packed_single operator/(const packed_single &l, const packed_single &r) {
+            return traits_t::Div(l._v, r._v);
+        }
+
+        friend packed_single operator&(const packed_single &l, const packed_single &r) {
+            return traits_t::And(l._v, r._v);
+        }
+
+        friend packed_single operator|(const packed_single &l, const packed_single &r) {
+            return traits_t::Or(l._v, r._v);
+        }
+
+        friend packed_single operator<=(const packed_single &l, const packed_single &r) {
+            return traits_t::CmpLE(l._v, r._v);
+        }
+
+        friend packed_single operator<(const packed_single &l, const packed_single &r) {
+            return traits_t::CmpLT(l._v, r._v);
+        }
+
+        friend packed_single Min(const packed_single &l, const packed_single &r) {
+            return traits_t::Min(l._v, r._v);
+        }
+
+        friend packed_single Max(const packed_single &l, const packed_single &r) {
+            return traits_t::Max(l._v, r._v);
+        }
+
+        // taken by value, so that it's preferred to the generic `Abs` for rvalues
+        friend packed_single Abs(packed_single v) {
+            return traits_t::AndNot(traits_t::Set1(-0.f), v._v);
+        }
+
+        /// @brief lanes of `t` are taken where the sign bit of `mask` is set, and lanes of `f` otherwise
+        friend packed_single Blend(const packed_single &f, const packed_single &t, const packed_single &mask) {
+            return traits_t::Blend(f._v, t._v, mask._v);
+        }
+    };
+}  // namespace igi
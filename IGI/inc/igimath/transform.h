@@ -122,15 +122,20 @@ namespace igi {
         }
 
         transform &scale(const vec3f &s) {
+            mat4x4f m(s[0], 0, 0, 0,
+                      0, s[1], 0, 0,
+                      0, 0, s[2], 0,
+                      0, 0, 0, 1);
+
+            _mat = m * _mat;
             for (size_t i = 0; i < 3; i++)
-                _mat.get(i, i) *= s[i];
+                m.get(i, i) = 1_sg / s[i];
+            _inv = _inv * m;
             return *this;
         }
 
         transform &scale(const single &s) {
-            for (size_t i = 0; i < 3; i++)
-                _mat.get(i, i) *= s;
-            return *this;
+            return scale(vec3f::One(s));
         }
 
         vec4f operator*(const vec4f &v) const {
@@ -1,16 +1,202 @@
 ﻿#pragma once
 
+#include <algorithm>
+#include <bit>
+#include <chrono>
 #include <functional>
 #include <memory_resource>
 #include <stack>
+#include <string_view>
+#include <typeinfo>
 #include "igiacceleration/circular_list.h"
+#include "igiacceleration/inline_stack.h"
 #include "igicontext.h"
 #include "igientity/entity.h"
+#include "igigeometry/cylinder.h"
+#include "igigeometry/ray_packet.h"
+#include "igigeometry/sphere.h"
+#include "igigeometry/triangle.h"
+#include "igimath/simd.h"
 
 namespace igi {
+    /// @brief algorithm by which trees of aggregates are built
+    enum class aggregate_build_method {
+        /// @brief spatial-split BVH binned by surface area heuristic, which is the best for traversal and the slowest to build
+        sbvh,
+        /// @brief linear BVH split at bits of Morton codes of centroids, which is the fastest to build
+        lbvh,
+        /// @brief linear BVH whose top levels over clusters of Morton codes are built by surface area heuristic
+        hlbvh
+    };
+
+    class aggregate_configuration {
+        size_t _width         = DefaultWidth;
+        bool _quantized       = false;
+        size_t _binCount      = DefaultBinCount;
+        size_t _batchSize     = DefaultBatchSize;
+        single _minSplitRatio = DefaultMinSplitRatio;
+        aggregate_build_method _buildMethod = aggregate_build_method::sbvh;
+        std::string_view _cachePath;
+
+      public:
+        /// @brief children per node of traversal, 2 for binary tree, 4 for SSE and 8 for AVX box tests
+        static constexpr size_t DefaultWidth = 8;
+
+        /// @brief bins along the widest dimension of a node, between which splits are evaluated
+        static constexpr size_t DefaultBinCount = 8;
+        static constexpr size_t MaxBinCount     = 32;
+
+        /// @brief groups of fewer entities are made leaves rather than split further
+        static constexpr size_t DefaultBatchSize = 4;
+
+        /// @brief spatial splits are tried for nodes whose surface area is above this ratio of the root's
+        static constexpr single DefaultMinSplitRatio = .01_sg;
+
+        constexpr aggregate_configuration() { }
+
+        /// @param width falls back to 2 unless it's 2, 4 or 8
+        aggregate_configuration &setWidth(size_t width) {
+            if (width != 2 && width != 4 && width != 8) {
+                LogError("aggregate width ", width, " is not one of 2, 4 or 8, falling back to 2");
+                width = 2;
+            }
+            return _width = width, *this;
+        }
+
+        constexpr size_t getWidth() const { return _width; }
+
+        /// @brief bounds of children of wide nodes are quantized to 8 bits relative to their parents,
+        /// which is ignored by binary tree and by scenes of unbounded entities
+        aggregate_configuration &setQuantized(bool quantized) {
+            return _quantized = quantized, *this;
+        }
+
+        constexpr bool isQuantized() const { return _quantized; }
+
+        /// @param count clamped to [2, MaxBinCount]
+        aggregate_configuration &setBinCount(size_t count) {
+            if (count < 2 || count > MaxBinCount) {
+                const size_t clamped = std::clamp<size_t>(count, 2, MaxBinCount);
+                LogError("aggregate bin count ", count, " is not in [2, ", MaxBinCount, "], clamping to ", clamped);
+                count = clamped;
+            }
+            return _binCount = count, *this;
+        }
+
+        constexpr size_t getBinCount() const { return _binCount; }
+
+        /// @param size falls back to 2 if it's less than 2
+        aggregate_configuration &setBatchSize(size_t size) {
+            if (size < 2) {
+                LogError("aggregate batch size ", size, " is less than 2, falling back to 2");
+                size = 2;
+            }
+            return _batchSize = size, *this;
+        }
+
+        constexpr size_t getBatchSize() const { return _batchSize; }
+
+        /// @param ratio 0 to try spatial splits everywhere, or 1 and above to disable them
+        aggregate_configuration &setMinSplitRatio(single ratio) {
+            if (!(ratio >= 0_sg)) {
+                LogError("aggregate split ratio ", ratio, " is negative, falling back to 0");
+                ratio = 0_sg;
+            }
+            return _minSplitRatio = ratio, *this;
+        }
+
+        constexpr single getMinSplitRatio() const { return _minSplitRatio; }
+
+        /// @brief linear builders ignore the bin count and the split ratio, except that `hlbvh` bins its top levels
+        aggregate_configuration &setBuildMethod(aggregate_build_method method) {
+            return _buildMethod = method, *this;
+        }
+
+        constexpr aggregate_build_method getBuildMethod() const { return _buildMethod; }
+
+        /// @brief file the built tree is cached in, which is loaded in place of building if it's cached from the same entities
+        /// and configuration, or written otherwise. an empty path disables caching
+        /// @param path expected to outlive construction of aggregates, and is not a part of the configuration the cache is keyed by
+        aggregate_configuration &setCachePath(std::string_view path) {
+            return _cachePath = path, *this;
+        }
+
+        constexpr std::string_view getCachePath() const { return _cachePath; }
+    };
+
+    /// @brief bytes held by parts of an aggregate, see `aggregate::getMemoryReport`
+    struct aggregate_memory_report {
+        /// @brief nodes of the tree in the form used for traversal
+        size_t nodes = 0;
+        /// @brief entity references and transforms baked for them
+        size_t prims = 0;
+        /// @brief triangle blocks and vertices baked for them
+        size_t triangles = 0;
+
+        constexpr size_t getTotal() const {
+            return nodes + prims + triangles;
+        }
+    };
+
+    /// @brief quality of the tree built by an aggregate, see `aggregate::getStatistics`.
+    /// the tree is measured in binary form as built, before it's collapsed to wide nodes
+    struct aggregate_statistics {
+        static constexpr size_t LeafSizeBinCount = 16;
+
+        size_t nodeCount = 0;
+        size_t leafCount = 0;
+        size_t entityCount = 0;
+        /// @brief entities referenced by leaves, which are more than entities if any is cut by spatial splits
+        size_t referenceCount = 0;
+
+        size_t maxDepth = 0;
+        /// @brief depth of leaves averaged over them, the root is of depth 0
+        single averageDepth = 0_sg;
+
+        /// @brief expected cost of a ray hitting the root by surface area heuristic,
+        /// with unit costs of visiting a node and intersecting an entity
+        single sahCost = 0_sg;
+
+        /// @brief the i-th bin counts leaves of i entities, while the last one counts larger leaves as well
+        size_t leafSizes[LeafSizeBinCount] = {};
+
+        double buildSeconds = 0.;
+
+        /// @brief whether the tree is loaded from the cache file, in which case `buildSeconds` is the time taken to load it
+        bool cached = false;
+
+        aggregate_memory_report memory;
+
+        single getDuplicationRatio() const {
+            return entityCount ? static_cast<single>(referenceCount) / static_cast<single>(entityCount) : 0_sg;
+        }
+    };
+
+    /// @brief nodes and entities visited by rays on a thread, which are counted only if `IGI_TRAVERSAL_STATISTICS` is defined,
+    /// see `aggregate::GetTraversalCounter`
+    struct aggregate_traversal_counter {
+        size_t rays  = 0;
+        size_t nodes = 0;
+        size_t prims = 0;
+
+        single getNodesPerRay() const {
+            return rays ? static_cast<single>(nodes) / static_cast<single>(rays) : 0_sg;
+        }
+
+        single getPrimsPerRay() const {
+            return rays ? static_cast<single>(prims) / static_cast<single>(rays) : 0_sg;
+        }
+
+        void reset() {
+            rays = nodes = prims = 0;
+        }
+    };
+
     class aggregate {
         struct node {
             bool childIsLeaf[2];
+            // dimension along which the node is split, the first child lies on the lower side
+            uint8_t axis;
             size_t children[2];
             size_t nchildrenLeaves[2];
             bound_t bound;
@@ -18,7 +204,7 @@ namespace igi {
             node() { }
 
             node(bool leftIsLeaf, size_t left, bool rightIsLeaf, size_t right, bound_t bound)
-                : childIsLeaf { leftIsLeaf, rightIsLeaf }, children { left, right }, bound(bound) { }
+                : childIsLeaf { leftIsLeaf, rightIsLeaf }, axis(0), children { left, right }, bound(bound) { }
         };
 
         struct leaf {
@@ -44,15 +230,431 @@ namespace igi {
 
         using build_itr_queue_t = circular_list<packed_leaf>;
 
+        /// @brief entity tagged with the type of its surface in the low bits of the pointer,
+        /// so that built-in surfaces are intersected without virtual calls, while other surfaces go through `ISurface`
+        class prim_ref {
+            uintptr_t _bits;
+
+          public:
+            enum class surface_type : uintptr_t { other    = 0,
+                                                  triangle = 1,
+                                                  sphere   = 2,
+                                                  cylinder = 3 };
+
+            static constexpr uintptr_t TypeMask = 3;
+
+            static_assert(alignof(entity) > TypeMask);
+
+            prim_ref() = default;
+
+            explicit prim_ref(const entity *e)
+                : _bits(reinterpret_cast<uintptr_t>(e) | static_cast<uintptr_t>(GetSurfaceType(e->getSurface()))) { }
+
+            const entity &getEntity() const {
+                return *reinterpret_cast<const entity *>(_bits & ~TypeMask);
+            }
+
+            surface_type getSurfaceType() const {
+                return static_cast<surface_type>(_bits & TypeMask);
+            }
+
+            /// @brief calls `fn(entity, ray, surface, baked...)`, where surface is of its exact type if it's built-in,
+            /// and the world-to-object transform is baked for analytic surfaces
+            template <typename TRay, typename TFn>
+            bool dispatch(TRay &&r, const compact_affine &w2o, TFn &&fn) const {
+                const entity &e      = getEntity();
+                const ISurface *surf = &e.getSurface();
+                switch (getSurfaceType()) {
+                    case surface_type::triangle:
+                        return fn(e, r, static_cast<const triangle *>(surf));
+                    case surface_type::sphere:
+                        return fn(e, r, static_cast<const sphere *>(surf), w2o);
+                    case surface_type::cylinder:
+                        return fn(e, r, static_cast<const cylinder *>(surf), w2o);
+                    default:
+                        return fn(e, r, surf);
+                }
+            }
+
+          private:
+            // subclasses of built-in surfaces may override intersection, thus exact types are compared
+            static surface_type GetSurfaceType(const ISurface &surf) {
+                const std::type_info &type = typeid(surf);
+                return type == typeid(triangle) ? surface_type::triangle
+                       : type == typeid(sphere) ? surface_type::sphere
+                       : type == typeid(cylinder) ? surface_type::cylinder
+                                                  : surface_type::other;
+            }
+        };
+
+        class builder;
+
+        class linear_builder;
+
+        /// @brief node for traversal, which is flattened from build nodes in depth-first order,
+        /// thus the first child of an interior node is the next node
+        struct alignas(32) flat_node {
+            static constexpr uint32_t LeafFlag = static_cast<uint32_t>(1) << 31;
+            /// @brief set for leaf of triangles only, whose offset is then the index of the first block in `_blocks`
+            static constexpr uint32_t BlockFlag = static_cast<uint32_t>(1) << 30;
+
+            bound_t bound;
+            /// @brief index of the first entity in `_prims` for leaf, or index of the second child for interior node
+            uint32_t offset;
+            /// @brief `LeafFlag` and `BlockFlag` combined with the number of entities for leaf, or split axis for interior node
+            uint32_t info;
+
+            flat_node() { }
+
+            flat_node(const bound_t &bound, uint32_t offset, uint32_t info)
+                : bound(bound), offset(offset), info(info) { }
+
+            bool isLeaf() const {
+                return info & LeafFlag;
+            }
+
+            uint32_t getCount() const {
+                return info & ~(LeafFlag | BlockFlag);
+            }
+
+            uint32_t getAxis() const {
+                return info;
+            }
+        };
+
+        // two nodes share a cache line as long as `single` is float
+        static_assert(sizeof(flat_node) == sizeof(bound_t) + 2 * sizeof(uint32_t));
+        static_assert(sizeof(single) != sizeof(float) || sizeof(flat_node) == 32);
+
+        /// @brief node for traversal of wide tree, which is collapsed from flattened binary tree.
+        /// bounds of children are stored in SoA form, so that they are tested at once
+        template <size_t N>
+        struct alignas(32) wide_node {
+            static constexpr size_t Size = N;
+
+            // min x, min y, min z, max x, max y, max z of each child
+            alignas(32) float bounds[6][N];
+            /// @brief index of the child node, or index of the first entity in `_prims` for leaf
+            uint32_t offsets[N];
+            /// @brief 0 for interior node, or `flat_node::LeafFlag` combined with the number of entities for leaf.
+            /// an empty slot is a leaf without entity, whose bound is never hit
+            uint32_t infos[N];
+
+            wide_node() { }
+
+            bool isLeaf(size_t i) const {
+                return infos[i] & flat_node::LeafFlag;
+            }
+
+            uint32_t getCount(size_t i) const {
+                return infos[i] & ~(flat_node::LeafFlag | flat_node::BlockFlag);
+            }
+
+            bound_t getBound(size_t i) const {
+                return bound_t(vec3f(bounds[0][i], bounds[1][i], bounds[2][i]),
+                               vec3f(bounds[3][i], bounds[4][i], bounds[5][i]));
+            }
+
+            void setChild(size_t i, const bound_t &bound, uint32_t offset, uint32_t info) {
+                for (size_t j = 0; j < 3; j++) {
+                    bounds[j][i]     = ToFloatBound<false>(bound.getMin(j));
+                    bounds[j + 3][i] = ToFloatBound<true>(bound.getMax(j));
+                }
+                offsets[i] = offset;
+                infos[i]   = info;
+            }
+
+            /// @brief vectorized counterpart of `aabb::isHit`, the i-th bit is set if the bound of i-th child is hit
+            unsigned getHitMask(const ray &r) const {
+                packed_single<N> tEntry;
+                return getHitMask(r, &tEntry);
+            }
+
+            /// @param tEntry distances at which the ray enters bounds of children
+            unsigned getHitMask(const ray &r, packed_single<N> *tEntry) const {
+                using packed_t = packed_single<N>;
+
+                const vec3f &o    = r.getOrigin();
+                const vec3f &invD = r.getInvDirection();
+                const packed_t robust(static_cast<float>(bound_t::RobustFactor));
+
+                packed_t t0(static_cast<float>(r.getTMin()));
+                packed_t t1(static_cast<float>(r.getT()));
+                for (size_t i = 0; i < 3; i++) {
+                    const bool neg = r.isNegDirection(i);
+                    const packed_t oi(static_cast<float>(o[i]));
+                    const packed_t invDi(static_cast<float>(invD[i]));
+
+                    const packed_t tNear = (packed_t::Load(bounds[neg ? i + 3 : i]) - oi) * invDi;
+                    const packed_t tFar  = (packed_t::Load(bounds[neg ? i : i + 3]) - oi) * invDi * robust;
+
+                    // min and max return the second operand if either is nan, thus nan distances are ignored as scalar test does
+                    t0 = Max(tNear, t0);
+                    t1 = Min(tFar, t1);
+                }
+
+                *tEntry = t0;
+                return (t0 <= t1).getMask();
+            }
+        };
+
+        /// @brief counterpart of `wide_node`, whose bounds of children are quantized to 8 bits in the grid over its own bound.
+        /// quantized bounds are rounded outwards, thus never smaller than exact ones, and decoded on the fly by traversal
+        template <size_t N>
+        struct alignas(16) quantized_node {
+            static constexpr size_t Size = N;
+
+            static constexpr uint8_t MaxLevel = 255;
+
+            // min of the bound of the node, and the size of grid cells along each dimension
+            float origin[3], scale[3];
+            // quantized min x, min y, min z, max x, max y, max z of each child
+            alignas(8) uint8_t bounds[6][N];
+            /// @brief the i-th bit is set if the i-th child is not an empty slot, whose quantized bound can't be empty
+            uint32_t childMask;
+            uint32_t offsets[N];
+            uint32_t infos[N];
+
+            quantized_node() { }
+
+            bool isLeaf(size_t i) const {
+                return infos[i] & flat_node::LeafFlag;
+            }
+
+            uint32_t getCount(size_t i) const {
+                return infos[i] & ~(flat_node::LeafFlag | flat_node::BlockFlag);
+            }
+
+            bound_t getBound(size_t i) const {
+                return bound_t(vec3f(decode(0, bounds[0][i]), decode(1, bounds[1][i]), decode(2, bounds[2][i])),
+                               vec3f(decode(0, bounds[3][i]), decode(1, bounds[4][i]), decode(2, bounds[5][i])));
+            }
+
+            /// @brief sets the grid, which is expected before any child is set
+            /// @param bound finite bound of the node
+            void setBound(const bound_t &bound) {
+                childMask = 0;
+                for (size_t j = 0; j < 3; j++) {
+                    const float max = ToFloatBound<true>(bound.getMax(j));
+
+                    origin[j] = ToFloatBound<false>(bound.getMin(j));
+                    scale[j]  = (max - origin[j]) / MaxLevel;
+                    while (decode(j, MaxLevel) < max)
+                        scale[j] = IncreaseBit(scale[j]);
+                }
+            }
+
+            void setChild(size_t i, const bound_t &bound, uint32_t offset, uint32_t info) {
+                offsets[i] = offset;
+                infos[i]   = info;
+
+                if (isLeaf(i) && !getCount(i)) {
+                    childMask &= ~(1u << i);
+                    return;
+                }
+
+                childMask |= 1u << i;
+                for (size_t j = 0; j < 3; j++) {
+                    bounds[j][i]     = quantize<false>(j, ToFloatBound<false>(bound.getMin(j)));
+                    bounds[j + 3][i] = quantize<true>(j, ToFloatBound<true>(bound.getMax(j)));
+                }
+            }
+
+            unsigned getHitMask(const ray &r) const {
+                packed_single<N> tEntry;
+                return getHitMask(r, &tEntry);
+            }
+
+            /// @brief counterpart of `wide_node::getHitMask`, which decodes bounds before slab tests
+            unsigned getHitMask(const ray &r, packed_single<N> *tEntry) const {
+                using packed_t = packed_single<N>;
+
+                const vec3f &o    = r.getOrigin();
+                const vec3f &invD = r.getInvDirection();
+                const packed_t robust(static_cast<float>(bound_t::RobustFactor));
+
+                packed_t t0(static_cast<float>(r.getTMin()));
+                packed_t t1(static_cast<float>(r.getT()));
+                for (size_t i = 0; i < 3; i++) {
+                    const bool neg = r.isNegDirection(i);
+                    const packed_t oi(static_cast<float>(o[i]));
+                    const packed_t invDi(static_cast<float>(invD[i]));
+                    const packed_t originI(origin[i]);
+                    const packed_t scaleI(scale[i]);
+
+                    const packed_t lo = originI + packed_t::LoadU8(bounds[neg ? i + 3 : i]) * scaleI;
+                    const packed_t hi = originI + packed_t::LoadU8(bounds[neg ? i : i + 3]) * scaleI;
+
+                    const packed_t tNear = (lo - oi) * invDi;
+                    const packed_t tFar  = (hi - oi) * invDi * robust;
+
+                    t0 = Max(tNear, t0);
+                    t1 = Min(tFar, t1);
+                }
+
+                *tEntry = t0;
+                return (t0 <= t1).getMask() & childMask;
+            }
+
+          private:
+            // decoded by the same vectorized operations as traversal, so that rounding outwards is exact
+            float decode(size_t dim, uint8_t level) const {
+                alignas(16) float res[4];
+                (packed_single<4>(origin[dim]) + packed_single<4>(static_cast<float>(level)) * packed_single<4>(scale[dim])).store(res);
+                return res[0];
+            }
+
+            template <bool Ceil>
+            uint8_t quantize(size_t dim, float coord) const {
+                const float level = scale[dim] > 0.f ? (coord - origin[dim]) / scale[dim] : 0.f;
+
+                int q = static_cast<int>(Ceil ? std::ceil(level) : std::floor(level));
+                q     = std::clamp(q, 0, static_cast<int>(MaxLevel));
+                if constexpr (Ceil)
+                    while (q < MaxLevel && decode(dim, static_cast<uint8_t>(q)) < coord)
+                        q++;
+                else
+                    while (q > 0 && coord < decode(dim, static_cast<uint8_t>(q)))
+                        q--;
+                return static_cast<uint8_t>(q);
+            }
+        };
+
+        /// @brief hit of a triangle whose distance and barycentric coordinates are found by `triangle_block`
+        struct triangle_block_hit {
+            single t;
+            vec3f coords;
+        };
+
+        /// @brief triangles of a leaf, whose vertices are transformed to world space and stored in SoA form.
+        /// a ray is tested against the whole block at once, which culls triangles missed for sure,
+        /// and finds distances and barycentric coordinates of triangles hit for sure.
+        /// only the rest, whose edge functions or distances are within error bounds, are left to `entity::tryHit`
+        struct alignas(16) triangle_block {
+            static constexpr size_t Size = 4;
+
+            // relative error bound of the fast test, which is far beyond rounding errors of single precision
+            static constexpr float ErrorFactor = 16.f * std::numeric_limits<float>::epsilon();
+
+            // vertices[v][dim][lane]
+            alignas(16) float vertices[3][3][Size];
+            const entity *entities[Size];
+            uint32_t count;
+
+            triangle_block() { }
+
+            void setTriangle(size_t lane, const entity *e, const triangle_vertices &world) {
+                for (size_t v = 0; v < 3; v++)
+                    for (size_t i = 0; i < 3; i++)
+                        vertices[v][i][lane] = static_cast<float>(world.positions[v][i]);
+                entities[lane] = e;
+            }
+
+            /// @brief results of `test` in SoA form, which are meaningful for lanes set in `certain` only
+            struct alignas(16) lane_hits {
+                /// @brief the i-th bit is set if the i-th triangle is possibly hit
+                unsigned candidates;
+                /// @brief the i-th bit is set if the i-th triangle is hit for sure, at `t` within the error `err`,
+                /// given the distance is less than that of the ray
+                unsigned certain;
+                alignas(16) float t[Size];
+                alignas(16) float err[Size];
+                alignas(16) float coords[3][Size];
+
+                triangle_block_hit get(size_t lane) const {
+                    return triangle_block_hit { t[lane], vec3f(coords[0][lane], coords[1][lane], coords[2][lane]) };
+                }
+            };
+
+            /// @brief watertight test in ray space as `triangle::tryHit` does, with error bounds on edge functions
+            void test(const ray &r, lane_hits *res) const {
+                using packed_t = packed_single<Size>;
+
+                const int perm[3] { r.getPermX(), r.getPermY(), r.getPermZ() };
+                const vec3f &o = r.getOrigin();
+
+                const packed_t sx(static_cast<float>(r.getShear()[0]));
+                const packed_t sy(static_cast<float>(r.getShear()[1]));
+                const packed_t sz(static_cast<float>(r.getInvDirectionZ()));
+                const packed_t zero(0.f);
+
+                // coordinates in ray space, and magnitudes of terms they are summed from
+                packed_t x[3], y[3], z[3], mx[3], my[3];
+                for (size_t v = 0; v < 3; v++) {
+                    const packed_t px = packed_t::Load(vertices[v][perm[0]]) - packed_t(static_cast<float>(o[perm[0]]));
+                    const packed_t py = packed_t::Load(vertices[v][perm[1]]) - packed_t(static_cast<float>(o[perm[1]]));
+                    const packed_t pz = packed_t::Load(vertices[v][perm[2]]) - packed_t(static_cast<float>(o[perm[2]]));
+
+                    x[v]  = px + sx * pz;
+                    y[v]  = py + sy * pz;
+                    z[v]  = pz * sz;
+                    mx[v] = Abs(px) + Abs(sx * pz);
+                    my[v] = Abs(py) + Abs(sy * pz);
+                }
+
+                // edge functions a01, a12, a20 of `triangle::tryHit`, e.g., a01 = cross(b - a, a)
+                unsigned pos = 0, neg = 0, allPos = ~0u, allNeg = ~0u;
+                packed_t e[3];
+                const packed_t factor(ErrorFactor);
+                for (size_t v = 0; v < 3; v++) {
+                    const size_t w = v == 2 ? 0 : v + 1;
+
+                    e[v]               = (x[w] - x[v]) * y[v] - (y[w] - y[v]) * x[v];
+                    const packed_t err = factor * ((mx[w] + mx[v]) * my[v] + (my[w] + my[v]) * mx[v]);
+
+                    const unsigned p = (err < e[v]).getMask(), n = (e[v] < zero - err).getMask();
+                    pos |= p;
+                    neg |= n;
+                    allPos &= p;
+                    allNeg &= n;
+                }
+
+                // the hit distance is a convex combination of distances of vertices
+                const packed_t zmin = Min(Min(z[0], z[1]), z[2]);
+                const packed_t zmax = Max(Max(z[0], z[1]), z[2]);
+                const packed_t tmax(static_cast<float>(r.getT() * bound_t::RobustFactor));
+
+                const unsigned behind = (zmax < zero).getMask();
+                const unsigned beyond = (tmax < zmin * packed_t(1.f - ErrorFactor)).getMask();
+
+                res->candidates = ~((pos & neg) | behind | beyond) & ((1u << count) - 1u);
+
+                // edge functions of the same sign for sure leave the determinant far from zero,
+                // and the distance is then the combination of distances of vertices weighted by them
+                const packed_t detInv = packed_t(1.f) / (e[0] + e[1] + e[2]);
+                const packed_t t      = (z[0] * e[1] + z[1] * e[2] + z[2] * e[0]) * detInv;
+                const packed_t err    = factor * Max(Max(Abs(z[0]), Abs(z[1])), Abs(z[2]));
+
+                res->certain = (allPos | allNeg) & (err < t).getMask() & res->candidates;
+
+                t.store(res->t);
+                err.store(res->err);
+                for (size_t v = 0; v < 3; v++)
+                    (e[v] * detInv).store(res->coords[v]);
+            }
+        };
+
       public:
         using initializer_list_t = std::initializer_list<const std::reference_wrapper<entity>>;
-        using itr_stack_t        = std::stack<const void *, std::pmr::vector<const void *>>;
+        /// @brief fallback of traversal stack for trees deeper than `InlineStackSize`
+        using itr_stack_t        = std::stack<uint32_t, std::pmr::vector<uint32_t>>;
+
+        static constexpr size_t InlineStackSize = 64;
 
         aggregate(aggregate &&o) = default;
 
         template <typename TIt>
-        aggregate(TIt &&entityIt, size_t n) {
+        aggregate(TIt &&entityIt, size_t n, const aggregate_configuration &config = aggregate_configuration())
+            : _config(config), _width(config.getWidth()), _quantized(config.isQuantized() && _width != 2), _stackSize(0) {
+            // scratch of the build is reclaimed once it's done
+            const auto scope = context::GetScope();
+            const auto start = std::chrono::high_resolution_clock::now();
+
             initBuild(std::forward<TIt>(entityIt), n);
+            initStackSize();
+
+            _stats.entityCount  = n;
+            _stats.buildSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
         }
 
         aggregate &operator=(const aggregate &) = delete;
@@ -60,110 +662,776 @@ namespace igi {
 
         ~aggregate() = default;
 
+        /// @brief bound of all entities, which is singular if there is none
+        bound_t getBound() const {
+            switch (_width) {
+                case 4:
+                    return _quantized ? GetWideBound(_quantized4) : GetWideBound(_nodes4);
+                case 8:
+                    return _quantized ? GetWideBound(_quantized8) : GetWideBound(_nodes8);
+                default:
+                    return _nodes.empty() ? bound_t::NegInf() : _nodes.front().bound;
+            }
+        }
+
+        /// @brief statistics of the tree, along with the time taken to build it and memory held by it
+        aggregate_statistics getStatistics() const {
+            aggregate_statistics res = _stats;
+            res.memory               = getMemoryReport();
+            return res;
+        }
+
+        /// @brief updates bounds of nodes bottom-up from current bounds of entities, along with data baked from their transforms.
+        /// the topology of the tree is kept, which degrades as entities move.
+        /// references cut by spatial splits are refitted to whole bounds of entities, which are looser than clipped ones
+        void refit() {
+            refit(SingleInf);
+        }
+
+        /// @brief refits the tree, and then rebuilds subtrees whose SAH costs have grown over `threshold` times their costs when built.
+        /// rebuilt subtrees are appended and the arrays are then compacted, so that replaced subtrees don't pile up over refits.
+        /// statistics are updated along, see `refreshStatistics`
+        /// @param threshold ratio to costs when built, no less than 1
+        /// @return number of subtrees rebuilt
+        size_t refit(single threshold);
+
+        /// @brief counter of the calling thread, which is left untouched unless `IGI_TRAVERSAL_STATISTICS` is defined
+        static aggregate_traversal_counter &GetTraversalCounter() {
+            thread_local aggregate_traversal_counter counter;
+            return counter;
+        }
+
+        /// @brief whether bounds of nodes are quantized, which is false if unbounded entities are present even if configured
+        bool isQuantized() const {
+            return _quantized;
+        }
+
+        aggregate_memory_report getMemoryReport() const {
+            aggregate_memory_report res;
+            res.nodes     = GetCapacity(_nodes) + GetCapacity(_nodes4) + GetCapacity(_nodes8) + GetCapacity(_quantized4) + GetCapacity(_quantized8);
+            res.prims     = GetCapacity(_prims) + GetCapacity(_affines);
+            res.triangles = GetCapacity(_blocks) + GetCapacity(_vertices);
+            return res;
+        }
+
+        /// @brief any-hit query, which tells whether anything lies on the ray within (0, tmax).
+        /// it stops at the first hit found in whatever order, and no interaction is computed
+        bool occluded(const ray &r, single tmax, itr_stack_t &itrtmp) const {
+            ray shadow = r;
+            shadow.setT(tmax);
+            return isHit(shadow, itrtmp);
+        }
+
         bool isHit(const ray &r, itr_stack_t &itrtmp) const {
-            return hit_impl<true>(r, itrtmp,
-                                  [](const entity &e, const ray &r) { return e.isHit(r); });
+            return isHit(r, &itrtmp);
         }
 
         bool tryHit(ray &r, interaction *res, itr_stack_t &itrtmp) const {
-            interaction tmp;
-            tmp.entityId = interaction::EntityIDNull;
+            return tryHit(r, res, &itrtmp);
+        }
 
-            bool hit = hit_impl<false>(r, itrtmp,
-                                       [&](const entity &e, ray &r) {
-                                           return interaction::EntityToID(&e) != tmp.entityId && e.tryHit(r, &tmp);
-                                       });
+        /// @brief counterparts for callers without a fallback stack at hand, e.g., surfaces holding aggregates of their own.
+        /// a fallback stack is created only if the tree is too deep for the inline one
+        bool isHit(const ray &r) const {
+            return isHit(r, nullptr);
+        }
+
+        bool tryHit(ray &r, interaction *res) const {
+            return tryHit(r, res, nullptr);
+        }
+
+        /// @brief closest-hit query of a packet, whose rays are tested against boxes at once,
+        /// while entities in leaves are intersected ray by ray
+        /// @param res interactions of rays, which are meaningful for hit lanes only
+        /// @return the i-th bit is set if the i-th ray hits anything
+        unsigned tryHit(ray_packet &packet, interaction *res, itr_stack_t &itrtmp) const {
+            // entries of the packet stack carry lane masks, thus deep trees fall back to single rays
+            if (_stackSize > InlineStackSize) {
+                unsigned hit = 0;
+                for (unsigned mask = packet.getActiveMask(); mask; mask &= mask - 1) {
+                    const size_t lane = std::countr_zero(mask);
+                    if (tryHit(packet[lane], res + lane, itrtmp))
+                        hit |= 1u << lane;
+                }
+                return hit;
+            }
+
+            closest_hit closests[ray_packet::Size];
 
-            *res = tmp;
+            auto fn = [&](const entity &e, size_t lane, const auto *surf, const auto &...baked) {
+                return closests[lane].tryHit(e, packet[lane], surf, baked...);
+            };
+
+            CountTraversal(&aggregate_traversal_counter::rays, std::popcount(packet.getActiveMask()));
+
+            inline_stack<packet_entry, InlineStackSize> stack;
+            unsigned hit;
+            switch (_width) {
+                case 4:
+                    hit = _quantized ? hitPacketWide<quantized_node<4>>(packet, stack, fn) : hitPacketWide<wide_node<4>>(packet, stack, fn);
+                    break;
+                case 8:
+                    hit = _quantized ? hitPacketWide<quantized_node<8>>(packet, stack, fn) : hitPacketWide<wide_node<8>>(packet, stack, fn);
+                    break;
+                default:
+                    hit = hitPacketBinary(packet, stack, fn);
+                    break;
+            }
+
+            for (unsigned mask = packet.getActiveMask(); mask; mask &= mask - 1) {
+                const size_t lane = std::countr_zero(mask);
+                closests[lane].computeInteraction(packet[lane], res + lane);
+            }
             return hit;
         }
 
       private:
-        std::pmr::vector<node> _nodes;
-        std::pmr::vector<leaf> _leaves;
+        aggregate_configuration _config;
+
+        size_t _width;
+
+        bool _quantized;
+
+        // the maximum number of nodes on the traversal stack, which is determined by the depth of the tree
+        size_t _stackSize;
+
+        aggregate_statistics _stats;
+
+        // SAH costs of subtrees of traversal nodes when they're built, relative to surface areas of their roots
+        std::pmr::vector<single> _costs;
+
+        // only one of them is used for traversal, which is determined by `_width` and `_quantized`
+        std::pmr::vector<flat_node> _nodes;
+        std::pmr::vector<wide_node<4>> _nodes4;
+        std::pmr::vector<wide_node<8>> _nodes8;
+        std::pmr::vector<quantized_node<4>> _quantized4;
+        std::pmr::vector<quantized_node<8>> _quantized8;
+
+        std::pmr::vector<prim_ref> _prims;
+        // world-to-object transforms of entities in `_prims`, which are meaningful for analytic surfaces only
+        std::pmr::vector<compact_affine> _affines;
+        std::pmr::vector<triangle_block> _blocks;
+        // vertices of triangles in blocks, which are baked in world space so that transforms are skipped by exact tests
+        std::pmr::vector<triangle_vertices> _vertices;
+
+        static void initBuild(build_itr_queue_t iterations, std::pmr::vector<node> &nodes, std::pmr::vector<leaf> &leaves,
+                              const aggregate_configuration &config);
+
+        /// @brief builds the tree of entities over nodes, leaves are referenced by nodes in groups
+        static void BuildNodes(const leaf *entities, size_t n, const aggregate_configuration &config,
+                               std::pmr::vector<node> &nodes, std::pmr::vector<leaf> &leaves);
+
+        /// @brief counterpart of `BuildNodes` for linear build methods, which is expected for more than 2 entities
+        static void BuildLinearNodes(const leaf *entities, size_t n, const aggregate_configuration &config,
+                                     std::pmr::vector<node> &nodes, std::pmr::vector<leaf> &leaves);
+
+        /// @brief builds the tree into traversal nodes, which are expected to be empty if `whole` is set,
+        /// otherwise the tree is appended as a subtree and statistics are left untouched
+        /// @return index of the root of the tree in traversal nodes
+        uint32_t build(const leaf *entities, size_t n, bool whole);
+
+        void initCosts();
+
+        /// @brief evaluates bounds and costs of traversal nodes bottom-up from current bounds of entities
+        /// @param update whether bounds of nodes and data baked for entities are updated as well
+        void evaluate(std::pmr::vector<bound_t> &bounds, std::pmr::vector<single> &costs, bool update);
+
+        template <typename TNode>
+        void evaluateWide(std::pmr::vector<TNode> &nodes, std::pmr::vector<bound_t> &bounds, std::pmr::vector<single> &costs, bool update);
+
+        bound_t evaluateLeaf(uint32_t offset, uint32_t info, bool update);
+
+        /// @brief rebuilds subtrees whose costs have grown over the threshold, the whole tree is rebuilt if the root is
+        size_t rebuildDegraded(const std::pmr::vector<single> &costs, single threshold);
+
+        /// @brief rebuilds the subtree of `node` and appends it, which is then referenced by `parent` in place of the old one
+        /// @param slot the child slot of wide parent, or ignored by binary parent whose second child is replaced
+        void rebuildSubtree(uint32_t node, uint32_t parent, size_t slot);
+
+        /// @brief drops nodes and leaves unreachable from the root, which are left by `rebuildSubtree`.
+        /// reachable ones are copied in depth-first order, thus parents are still placed before their children
+        void compact();
+
+        template <typename TNode>
+        uint32_t compactWide(std::pmr::vector<TNode> &dst, const std::pmr::vector<TNode> &src, uint32_t index,
+                             std::pmr::vector<prim_ref> &prims, std::pmr::vector<compact_affine> &affines,
+                             std::pmr::vector<triangle_block> &blocks, std::pmr::vector<triangle_vertices> &vertices) const;
+
+        uint32_t compactBinary(std::pmr::vector<flat_node> &dst, uint32_t index,
+                               std::pmr::vector<prim_ref> &prims, std::pmr::vector<compact_affine> &affines,
+                               std::pmr::vector<triangle_block> &blocks, std::pmr::vector<triangle_vertices> &vertices) const;
+
+        /// @brief copies entities of a leaf to the end of compacted arrays
+        /// @return offset of the leaf in compacted arrays
+        uint32_t compactLeaf(uint32_t offset, uint32_t info,
+                             std::pmr::vector<prim_ref> &prims, std::pmr::vector<compact_affine> &affines,
+                             std::pmr::vector<triangle_block> &blocks, std::pmr::vector<triangle_vertices> &vertices) const;
+
+        /// @brief measures the tree again once subtrees are rebuilt, which is expected to be compacted with costs evaluated.
+        /// binary trees are measured as when built, while wide ones are measured over wide nodes, as their binary forms are gone
+        /// @param seconds time taken to rebuild subtrees, which is added to the build time
+        void refreshStatistics(double seconds);
+
+        /// @brief distinct entities referenced by leaves of the subtree of `node`
+        std::pmr::vector<leaf> gatherEntities(uint32_t node) const;
+
+        void flatten(std::pmr::vector<flat_node> &flat, const std::pmr::vector<node> &nodes, const std::pmr::vector<leaf> &leaves);
+
+        uint32_t flattenNode(std::pmr::vector<flat_node> &flat, const std::pmr::vector<node> &nodes, const std::pmr::vector<leaf> &leaves, size_t index);
+
+        uint32_t flattenLeaves(std::pmr::vector<flat_node> &flat, const leaf *lo, size_t nleaves);
+
+        /// @return index of the wide node collapsed from the root of `flat`
+        uint32_t collapse(const std::pmr::vector<flat_node> &flat, bool whole);
+
+        void initStackSize();
+
+        void initStatistics(const std::pmr::vector<flat_node> &flat);
+
+        /// @brief hash of entities and the configuration, by which the cache file is validated.
+        /// entities are identified by their order, thus the cache is invalidated once any of them is added, removed or moved
+        static uint64_t GetCacheKey(const leaf *entities, size_t n, const aggregate_configuration &config);
+
+        /// @brief loads the tree from the cache file, which is rejected unless it's written with the same key
+        /// @return whether the tree is loaded, otherwise the aggregate is left empty
+        bool loadCache(const leaf *entities, size_t n, uint64_t key);
 
-        void initBuild(build_itr_queue_t iterations);
+        /// @brief writes the built tree to the cache file, failures of which are ignored since the cache is optional
+        void saveCache(const leaf *entities, size_t n, uint64_t key) const;
+
+        static void CountTraversal([[maybe_unused]] size_t aggregate_traversal_counter::*counter, [[maybe_unused]] size_t n = 1) {
+#ifdef IGI_TRAVERSAL_STATISTICS
+            GetTraversalCounter().*counter += n;
+#endif
+        }
+
+        template <typename TNode>
+        static uint32_t Collapse(std::pmr::vector<TNode> &wide, const std::pmr::vector<flat_node> &flat, uint32_t index);
+
+        template <typename TNode>
+        static bound_t GetWideBound(const std::pmr::vector<TNode> &nodes) {
+            bound_t res = bound_t::NegInf();
+            if (!nodes.empty())
+                for (size_t i = 0; i < TNode::Size; i++)
+                    if (!nodes.front().isLeaf(i) || nodes.front().getCount(i))
+                        res.extend(nodes.front().getBound(i));
+            return res;
+        }
+
+        template <typename T>
+        static size_t GetCapacity(const std::pmr::vector<T> &vec) {
+            return vec.capacity() * sizeof(T);
+        }
+
+        /// @brief calls `fn` with wide nodes used for traversal, which is not expected for binary tree
+        template <typename TSelf, typename TFn>
+        static decltype(auto) VisitWideNodes(TSelf &self, TFn &&fn) {
+            igiassert(self._width != 2);
+            if (self._width == 4)
+                return self._quantized ? fn(self._quantized4) : fn(self._nodes4);
+            return self._quantized ? fn(self._quantized8) : fn(self._nodes8);
+        }
+
+        bool isEmpty() const {
+            return _width == 2 ? _nodes.empty() : VisitWideNodes(*this, [](const auto &nodes) { return nodes.empty(); });
+        }
+
+        static single GetSurfaceArea(const bound_t &b) {
+            vec3f size = b.getDiagonal();
+            return size[0] * size[1] + size[1] * size[2] + size[2] * size[0];
+        }
+
+        template <typename TNode>
+        std::pmr::vector<TNode> &getWideNodes() {
+            if constexpr (std::is_same_v<TNode, wide_node<4>>)
+                return _nodes4;
+            else if constexpr (std::is_same_v<TNode, wide_node<8>>)
+                return _nodes8;
+            else if constexpr (std::is_same_v<TNode, quantized_node<4>>)
+                return _quantized4;
+            else
+                return _quantized8;
+        }
+
+        template <typename TNode>
+        const std::pmr::vector<TNode> &getWideNodes() const {
+            return const_cast<aggregate *>(this)->getWideNodes<TNode>();
+        }
 
         template <typename TIt>
         void initBuild(TIt &&entityIt, size_t n) {
+            new (&_nodes) std::pmr::vector<flat_node>(context::GetTypedAllocator<flat_node>());
+            new (&_nodes4) std::pmr::vector<wide_node<4>>(context::GetTypedAllocator<wide_node<4>>());
+            new (&_nodes8) std::pmr::vector<wide_node<8>>(context::GetTypedAllocator<wide_node<8>>());
+            new (&_quantized4) std::pmr::vector<quantized_node<4>>(context::GetTypedAllocator<quantized_node<4>>());
+            new (&_quantized8) std::pmr::vector<quantized_node<8>>(context::GetTypedAllocator<quantized_node<8>>());
+            new (&_prims) std::pmr::vector<prim_ref>(context::GetTypedAllocator<prim_ref>());
+            new (&_affines) std::pmr::vector<compact_affine>(context::GetTypedAllocator<compact_affine>());
+            new (&_blocks) std::pmr::vector<triangle_block>(context::GetTypedAllocator<triangle_block>());
+            new (&_vertices) std::pmr::vector<triangle_vertices>(context::GetTypedAllocator<triangle_vertices>());
+            new (&_costs) std::pmr::vector<single>(context::GetTypedAllocator<single>());
+
             if (!n)
                 return;
 
-            new (&_leaves) std::pmr::vector<leaf>(n, context::GetTypedAllocator<leaf>());
+            std::pmr::vector<leaf> entities(context::GetTypedAllocator<leaf, allocate_usage::temp>());
+            entities.reserve(n);
+            for (size_t i = 0; i < n; i++, ++entityIt)
+                entities.emplace_back(*entityIt, (*entityIt).getBound());
 
-            if (n < 3) {
-                new (&_nodes) std::pmr::vector<node>(1, context::GetTypedAllocator<node>());
-                new (_leaves.data()) leaf(*entityIt, (*entityIt).getBound());
-                if (n == 1) {
-                    new (_nodes.data()) node(true, 0, false, 0, _leaves[0].bound);
-                    _nodes.front().nchildrenLeaves[0] = 1;
-                }
-                else if (n == 2) {
-                    ++entityIt;
-                    new (_leaves.data() + 1) leaf(*entityIt, (*entityIt).getBound());
+            if (_config.getCachePath().empty()) {
+                build(entities.data(), n, true);
+                initCosts();
+                return;
+            }
+
+            const uint64_t key = GetCacheKey(entities.data(), n, _config);
+            if (!loadCache(entities.data(), n, key)) {
+                build(entities.data(), n, true);
+                saveCache(entities.data(), n, key);
+            }
+            initCosts();
+        }
+
+        /// @brief adapts `itr_stack_t` to the interface of `inline_stack`, elements pushed before are left untouched
+        class itr_stack_view {
+            itr_stack_t &_stack;
+
+            const size_t _base;
+
+          public:
+            explicit itr_stack_view(itr_stack_t &stack) : _stack(stack), _base(stack.size()) { }
+
+            itr_stack_view(const itr_stack_view &) = delete;
+            itr_stack_view(itr_stack_view &&)      = delete;
+
+            ~itr_stack_view() {
+                while (_stack.size() > _base)
+                    _stack.pop();
+            }
+
+            bool empty() const {
+                return _stack.size() == _base;
+            }
+
+            void push(uint32_t e) {
+                _stack.push(e);
+            }
+
+            uint32_t pop() {
+                uint32_t e = _stack.top();
+                _stack.pop();
+                return e;
+            }
+        };
+
+        /// @param itrtmp fallback stack for deep trees, which is created here if it's null
+        bool isHit(const ray &r, itr_stack_t *itrtmp) const {
+            return hit_impl<true>(r, itrtmp,
+                                  [](const entity &e, const ray &r, const auto *surf, const auto &...baked) {
+                                      return e.isHit(r, surf, baked...);
+                                  });
+        }
+
+        bool tryHit(ray &r, interaction *res, itr_stack_t *itrtmp) const {
+            closest_hit closest;
+
+            bool hit = hit_impl<false>(r, itrtmp,
+                                       [&](const entity &e, ray &r, const auto *surf, const auto &...baked) {
+                                           return closest.tryHit(e, r, surf, baked...);
+                                       });
+
+            closest.computeInteraction(r, res);
+            return hit;
+        }
+
+        template <bool FindFirst, typename TRay, typename TFn>
+        bool hit_impl(TRay &&r, itr_stack_t *itrtmp, TFn &&fn) const {
+            CountTraversal(&aggregate_traversal_counter::rays);
+
+            if (_stackSize <= InlineStackSize) {
+                inline_stack<uint32_t, InlineStackSize> stack;
+                return traverse<FindFirst>(r, stack, fn);
+            }
+
+            if (itrtmp) {
+                itr_stack_view stack(*itrtmp);
+                return traverse<FindFirst>(r, stack, fn);
+            }
+
+            itr_stack_t local(context::GetTypedAllocator<uint32_t, allocate_usage::thread_temp>());
+            itr_stack_view stack(local);
+            return traverse<FindFirst>(r, stack, fn);
+        }
+
+        template <bool FindFirst, typename TRay, typename TStack, typename TFn>
+        bool traverse(TRay &&r, TStack &stack, TFn &&fn) const {
+            switch (_width) {
+                case 4:
+                    return _quantized ? hitWide<quantized_node<4>, FindFirst>(r, stack, fn) : hitWide<wide_node<4>, FindFirst>(r, stack, fn);
+                case 8:
+                    return _quantized ? hitWide<quantized_node<8>, FindFirst>(r, stack, fn) : hitWide<wide_node<8>, FindFirst>(r, stack, fn);
+                default:
+                    return hitBinary<FindFirst>(r, stack, fn);
+            }
+        }
+
+        template <bool FindFirst, typename TRay, typename TStack, typename TFn>
+        bool hitBinary(TRay &&r, TStack &stack, TFn &&fn) const {
+            if (_nodes.empty())
+                return false;
+
+            bool hit      = false;
+            uint32_t curr = 0;
+            while (true) {
+                const flat_node &n = _nodes[curr];
+                CountTraversal(&aggregate_traversal_counter::nodes);
+
+                // the bound is tested against the closest hit so far, which culls nodes behind it
+                if (n.bound.isHit(r)) {
+                    if (!n.isLeaf()) {
+                        // visit the child nearer to the ray origin first, any hit will do for occlusion
+                        uint32_t first = curr + 1, second = n.offset;
+                        if (!FindFirst && r.isNegDirection(n.getAxis()))
+                            std::swap(first, second);
 
-                    bound_t b = _leaves[0].bound;
-                    new (_nodes.data()) node(true, 0, true, 1, b.extend(_leaves[1].bound));
-                    _nodes.front().nchildrenLeaves[0] = 1;
-                    _nodes.front().nchildrenLeaves[1] = 1;
+                        stack.push(second);
+                        curr = first;
+                        continue;
+                    }
+
+                    if (hitLeaf<FindFirst>(r, n.offset, n.info, fn)) {
+                        hit = true;
+
+                        if constexpr (FindFirst)
+                            return true;
+                    }
                 }
-                return;
+
+                if (stack.empty())
+                    break;
+
+                curr = stack.pop();
             }
+            return hit;
+        }
+
+        template <typename TNode, bool FindFirst, typename TRay, typename TStack, typename TFn>
+        bool hitWide(TRay &&r, TStack &stack, TFn &&fn) const {
+            static constexpr size_t N = TNode::Size;
+
+            const std::pmr::vector<TNode> &nodes = getWideNodes<TNode>();
+            if (nodes.empty())
+                return false;
 
-            new (&_nodes) std::pmr::vector<node>(n - 1, context::GetTypedAllocator<node>());
-            _nodes.clear();
+            bool hit      = false;
+            uint32_t curr = 0;
+            while (true) {
+                const TNode &n = nodes[curr];
+                CountTraversal(&aggregate_traversal_counter::nodes);
 
-            build_itr_queue_t iterations(n * 2, context::GetTypedAllocator<packed_leaf, allocate_usage::temp>());
-            iterations.resize(n + 1);
+                packed_single<N> tEntry;
+                unsigned mask = n.getHitMask(r, &tEntry);
 
-            iterations.front().nleaves = n;
-            std::for_each(++iterations.begin(), iterations.end(), [&](packed_leaf &i) {
-                new (&i.leaf) leaf(*entityIt, (*entityIt).getBound());
-                ++entityIt;
-            });
+                alignas(32) float tEntries[N];
+                tEntry.store(tEntries);
+
+                // sort hit children by entry distance, i.e., front to back, any hit will do for occlusion
+                size_t order[N], nhit = 0;
+                for (; mask; mask &= mask - 1) {
+                    const size_t i = std::countr_zero(mask);
+
+                    size_t j = nhit++;
+                    if constexpr (!FindFirst)
+                        for (; j && tEntries[i] < tEntries[order[j - 1]]; j--)
+                            order[j] = order[j - 1];
+                    order[j] = i;
+                }
 
-            _leaves.clear();
-            initBuild(std::move(iterations));
+                uint32_t children[N];
+                size_t nchildren = 0;
+                for (size_t k = 0; k < nhit; k++) {
+                    const size_t i = order[k];
+
+                    // children behind the closest hit so far are culled
+                    if (static_cast<single>(r.getT()) < tEntries[i])
+                        break;
+
+                    if (!n.isLeaf(i)) {
+                        children[nchildren++] = n.offsets[i];
+                        continue;
+                    }
+
+                    if (hitLeaf<FindFirst>(r, n.offsets[i], n.infos[i], fn)) {
+                        hit = true;
+
+                        if constexpr (FindFirst)
+                            return true;
+                    }
+                }
+
+                // the nearest child is on the top
+                while (nchildren)
+                    stack.push(children[--nchildren]);
+
+                if (stack.empty())
+                    break;
+
+                curr = stack.pop();
+            }
+            return hit;
         }
 
+        /// @brief analytic surfaces with baked transforms leave interactions in object space,
+        /// which are brought to world space once the closest hit is known
+        template <typename... TBaked>
+        static constexpr bool IsObjectSpace = (std::is_same_v<std::remove_cvref_t<TBaked>, compact_affine> || ...);
+
+        /// @brief closest hit found so far by a ray. built-in surfaces with baked data record the hit only,
+        /// whose interaction is computed once traversal ends, while other surfaces compute interactions as they're hit
+        class closest_hit {
+            const entity *_entity = nullptr;
+            // data baked for the surface hit, i.e., `triangle_vertices` or `compact_affine`
+            const void *_baked;
+            surface_hit _hit;
+            // null if the interaction is already computed in `_res`
+            void (*_compute)(const closest_hit &, const ray &, interaction *) = nullptr;
+            interaction _res;
+
+          public:
+            template <typename T, typename... TBaked>
+            bool tryHit(const entity &e, ray &r, const T *surf, const TBaked &...baked) {
+                if (&e == _entity)
+                    return false;
+
+                if constexpr (sizeof...(TBaked) == 1) {
+                    if (!e.tryHit(r, &_hit, surf, baked...))
+                        return false;
+
+                    _baked   = (&baked, ...);
+                    _compute = &Compute<T, TBaked...>;
+                }
+                else {
+                    if (!e.tryHit(r, &_res, surf, baked...))
+                        return false;
+
+                    _compute = nullptr;
+                }
+
+                _entity = &e;
+                return true;
+            }
+
+            /// @brief takes a hit found by `triangle_block` as it is, which is known to be closer than the ray
+            bool tryHit(const entity &e, ray &r, const triangle *, const triangle_vertices &world, const triangle_block_hit &h) {
+                if (&e == _entity)
+                    return false;
+
+                r.setT(h.t);
+                _hit.coords = h.coords;
+                _baked      = &world;
+                _compute    = &Compute<triangle, triangle_vertices>;
+                _entity     = &e;
+                return true;
+            }
+
+            /// @param r the ray whose distance is that of the closest hit
+            /// @param res left with null entity if nothing is hit
+            void computeInteraction(const ray &r, interaction *res) const {
+                if (!_entity)
+                    res->entityId = interaction::EntityIDNull;
+                else if (_compute)
+                    _compute(*this, r, res);
+                else
+                    *res = _res;
+            }
+
+          private:
+            template <typename T, typename TBaked>
+            static void Compute(const closest_hit &self, const ray &r, interaction *res) {
+                const entity &e = *self._entity;
+                e.computeInteraction(r, self._hit, res, static_cast<const T *>(&e.getSurface()), *static_cast<const TBaked *>(self._baked));
+
+                if constexpr (IsObjectSpace<TBaked>)
+                    ISurface::ToWorldSpace(e.getTransform(), &res->surface);
+            }
+        };
+
+        /// @brief node to be visited by a packet, along with lanes that hit its bound
+        struct packet_entry {
+            uint32_t node;
+            unsigned mask;
+        };
+
+        /// @brief tests entities of a leaf, triangles in blocks are culled at once before tested one by one.
+        /// `fn(entity, ray, surface, baked...)` is called with surface of its exact type if it's built-in,
+        /// and with vertices in world space for triangles in blocks
         template <bool FindFirst, typename TRay, typename TFn>
-        bool hit_impl(TRay &&r, itr_stack_t &itrtmp, TFn &&fn) const {
-            const size_t emptySize = itrtmp.size();
+        bool hitLeaf(TRay &&r, uint32_t offset, uint32_t info, TFn &&fn) const {
+            const uint32_t count = info & ~(flat_node::LeafFlag | flat_node::BlockFlag);
 
             bool hit = false;
-            itrtmp.push(_nodes.data());
-            do {
-                const node *curr = static_cast<const node *>(itrtmp.top());
-                itrtmp.pop();
-                igiassert(curr);
-
-                if (curr->bound.isHit(r)) {
-                    for (size_t i = 0; i < 2; i++)
-                        if (curr->childIsLeaf[i]) {
-                            const auto nleaves  = curr->nchildrenLeaves[i];
-                            const auto leavesLo = curr->children[i];
-
-                            for (size_t j = 0; j < nleaves; j++) {
-                                const leaf &l = _leaves[j + leavesLo];
-
-                                if (l.bound.isHit(r) && fn(*l.entity, r)) {
-                                    hit = true;
-
-                                    if constexpr (FindFirst) {
-                                        do
-                                            itrtmp.pop();
-                                        while (itrtmp.size() > emptySize);
-                                        goto end;
-                                    }
-                                }
-                            }
+            if (!(info & flat_node::BlockFlag)) {
+                const prim_ref *prims = &_prims[offset];
+                for (uint32_t i = 0; i < count; i++) {
+                    CountTraversal(&aggregate_traversal_counter::prims);
+                    if (prims[i].dispatch(r, _affines[offset + i], fn)) {
+                        hit = true;
+
+                        if constexpr (FindFirst)
+                            return true;
+                    }
+                }
+                return hit;
+            }
+
+            const triangle_block *block       = &_blocks[offset];
+            const triangle_vertices *vertices = &_vertices[offset * triangle_block::Size];
+            triangle_block::lane_hits hits;
+            for (uint32_t i = 0; i < count; i += triangle_block::Size, ++block, vertices += triangle_block::Size) {
+                block->test(r, &hits);
+                for (unsigned mask = hits.candidates; mask; mask &= mask - 1) {
+                    const size_t lane    = std::countr_zero(mask);
+                    const entity &e      = *block->entities[lane];
+                    const triangle *surf = static_cast<const triangle *>(&e.getSurface());
+                    CountTraversal(&aggregate_traversal_counter::prims);
+
+                    // the distance is compared against that of the ray here, which may be shortened by other lanes
+                    if (hits.certain & (1u << lane)) {
+                        const single t = hits.t[lane], err = hits.err[lane];
+                        if (r.getT() < t - err)
+                            continue;
+                        if (t + err < r.getT()) {
+                            if constexpr (FindFirst)
+                                return true;
+                            else if (fn(e, r, surf, vertices[lane], hits.get(lane)))
+                                hit = true;
+                            continue;
                         }
-                        else if (curr->children[i])
-                            itrtmp.push(&_nodes[curr->children[i]]);
+                    }
+
+                    if (fn(e, r, surf, vertices[lane])) {
+                        hit = true;
+
+                        if constexpr (FindFirst)
+                            return true;
+                    }
+                }
+            }
+            return hit;
+        }
+
+        template <typename TFn>
+        unsigned hitPacketLeaf(ray_packet &packet, unsigned mask, uint32_t offset, uint32_t info, TFn &&fn) const {
+            unsigned hit = 0;
+            for (; mask; mask &= mask - 1) {
+                const size_t lane = std::countr_zero(mask);
+
+                auto laneFn = [&](const entity &e, ray &, const auto *surf, const auto &...baked) { return fn(e, lane, surf, baked...); };
+                if (hitLeaf<false>(packet[lane], offset, info, laneFn)) {
+                    hit |= 1u << lane;
+                    packet.updateT(lane);
+                }
+            }
+            return hit;
+        }
+
+        template <typename TStack, typename TFn>
+        unsigned hitPacketBinary(ray_packet &packet, TStack &stack, TFn &&fn) const {
+            if (_nodes.empty())
+                return 0;
+
+            unsigned hit = 0;
+            packet_entry curr{0, packet.getActiveMask()};
+            while (true) {
+                const flat_node &n = _nodes[curr.node];
+                CountTraversal(&aggregate_traversal_counter::nodes);
+
+                ray_packet::packed_t tEntry;
+                const unsigned mask = packet.getHitMask(n.bound, curr.mask, &tEntry);
+                if (mask) {
+                    if (!n.isLeaf()) {
+                        // rays of a packet are expected to head the same way, the first active one decides the order
+                        uint32_t first = curr.node + 1, second = n.offset;
+                        if (packet[std::countr_zero(mask)].isNegDirection(n.getAxis()))
+                            std::swap(first, second);
+
+                        stack.push(packet_entry{second, mask});
+                        curr = packet_entry{first, mask};
+                        continue;
+                    }
+
+                    hit |= hitPacketLeaf(packet, mask, n.offset, n.info, fn);
+                }
+
+                if (stack.empty())
+                    break;
+
+                curr = stack.pop();
+            }
+            return hit;
+        }
+
+        template <typename TNode, typename TStack, typename TFn>
+        unsigned hitPacketWide(ray_packet &packet, TStack &stack, TFn &&fn) const {
+            static constexpr size_t N = TNode::Size;
+
+            const std::pmr::vector<TNode> &nodes = getWideNodes<TNode>();
+            if (nodes.empty())
+                return 0;
+
+            unsigned hit = 0;
+            packet_entry curr{0, packet.getActiveMask()};
+            while (true) {
+                const TNode &n = nodes[curr.node];
+                CountTraversal(&aggregate_traversal_counter::nodes);
+
+                // children are sorted by entry distance of the first active lane which hits them
+                packet_entry children[N];
+                float tFirsts[N];
+                size_t nchildren = 0;
+                for (size_t i = 0; i < N; i++) {
+                    if (n.isLeaf(i) && !n.getCount(i))
+                        continue;
+
+                    ray_packet::packed_t tEntry;
+                    const unsigned mask = packet.getHitMask(n.getBound(i), curr.mask, &tEntry);
+                    if (!mask)
+                        continue;
+
+                    alignas(32) float tEntries[ray_packet::Size];
+                    tEntry.store(tEntries);
+                    const float tFirst = tEntries[std::countr_zero(mask)];
+
+                    size_t j = nchildren++;
+                    for (; j && tFirst < tFirsts[j - 1]; j--) {
+                        children[j] = children[j - 1];
+                        tFirsts[j]  = tFirsts[j - 1];
+                    }
+                    children[j] = packet_entry{static_cast<uint32_t>(i), mask};
+                    tFirsts[j]  = tFirst;
                 }
-            } while (itrtmp.size() > emptySize);
 
-end:
+                size_t ninteriors = 0;
+                for (size_t k = 0; k < nchildren; k++) {
+                    const size_t i = children[k].node;
+                    if (!n.isLeaf(i)) {
+                        children[ninteriors++] = packet_entry{n.offsets[i], children[k].mask};
+                        continue;
+                    }
+
+                    hit |= hitPacketLeaf(packet, children[k].mask, n.offsets[i], n.infos[i], fn);
+                }
+
+                // the nearest child is on the top
+                while (ninteriors)
+                    stack.push(children[--ninteriors]);
+
+                if (stack.empty())
+                    break;
+
+                curr = stack.pop();
+            }
             return hit;
         }
     };
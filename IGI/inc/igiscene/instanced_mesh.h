@@ -0,0 +1,152 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <memory_resource>
+#include "igigeometry/triangle.h"
+#include "igiscene/aggregate.h"
+
+namespace igi {
+    /// @brief triangle mesh with its own aggregate, which is built once in object space.
+    /// entities sharing it are instances of the mesh, a ray is transformed once per instance rather than per triangle.
+    /// the mesh is expected to outlive it
+    class instanced_mesh : public ISurface {
+        // triangles are placed in object space by the shared identity transform
+        std::pmr::vector<entity> _triangles;
+
+        // cumulative areas of triangles, by which they are sampled
+        std::pmr::vector<single> _cdf;
+
+        aggregate _aggregate;
+
+        bound_t _bound;
+
+      public:
+        META_BE_RT(instanced_mesh, ser_pmr_name_a("instanced mesh"), deser_pmr_func_a<ISurface>([](const serializer_t &ser) {
+                       // "list" or "fan", see `triangle_topology`
+                       IGI_SERIALIZE_OPTIONAL(std::string_view, topology, "list", ser);
+                       IGI_SERIALIZE_OPTIONAL(unsigned, bvhWidth, aggregate_configuration::DefaultWidth, ser);
+                       IGI_SERIALIZE_OPTIONAL(bool, bvhQuantized, false, ser);
+
+                       const serializer_t &pser = ser["positions"];
+                       std::pmr::vector<vec3f> positions(context::GetTypedAllocator<vec3f, allocate_usage::temp>());
+                       positions.reserve(pser.Size());
+                       for (auto i = pser.Begin(); i != pser.End(); ++i)
+                           positions.push_back(static_cast<vec3f>(serialization::Deserialize<vec3f>(*i)));
+
+                       const bool fan = topology == "fan";
+                       if (!fan && topology != "list")
+                           LogError("mesh topology \"", topology, "\" is neither \"list\" nor \"fan\", falling back to \"list\"");
+                       if (!fan && positions.size() % 3) {
+                           LogError("vertex count ", positions.size(), " of triangle list is not a multiple of 3, trailing vertices are dropped");
+                           positions.resize(positions.size() - positions.size() % 3);
+                       }
+
+                       // the mesh is never freed, as is the case for surfaces deserialized along with it
+                       triangle_mesh *mesh = context::New<triangle_mesh>();
+                       mesh->setPos(positions.begin(), positions.end());
+
+                       if (positions.size() < 3) {
+                           LogError("mesh of ", positions.size(), " vertices has no triangle");
+                           mesh->setTriangle(static_cast<const triangle *>(nullptr), static_cast<const triangle *>(nullptr));
+                       }
+                       else
+                           mesh->setTriangle(fan ? triangle_topology::fan : triangle_topology::list);
+
+                       if (ser.HasMember("uvs")) {
+                           const serializer_t &uvser = ser["uvs"];
+                           std::pmr::vector<vec2f> uvs(context::GetTypedAllocator<vec2f, allocate_usage::temp>());
+                           uvs.reserve(uvser.Size());
+                           for (auto i = uvser.Begin(); i != uvser.End(); ++i)
+                               uvs.push_back(static_cast<vec2f>(serialization::Deserialize<vec2f>(*i)));
+
+                           if (uvs.size() >= positions.size())
+                               mesh->setUV(uvs.begin(), uvs.begin() + positions.size());
+                           else
+                               LogError("mesh of ", positions.size(), " vertices has only ", uvs.size(), " uvs, which are ignored");
+                       }
+
+                       const aggregate_configuration config = aggregate_configuration().setWidth(bvhWidth).setQuantized(bvhQuantized);
+                       return static_cast<ISurface *>(context::New<instanced_mesh>(*mesh, config));
+                   }))
+
+        instanced_mesh(const triangle_mesh &mesh, const aggregate_configuration &config = aggregate_configuration())
+            : _triangles(InitTriangles(mesh)), _cdf(context::GetTypedAllocator<single>()),
+              _aggregate(_triangles.data(), _triangles.size(), config), _bound(_aggregate.getBound()) {
+            _cdf.reserve(_triangles.size());
+
+            single area = 0_sg;
+            for (const entity &e : _triangles)
+                _cdf.push_back(area += e.getSurface().getArea());
+        }
+
+        single getArea() const override {
+            return _cdf.empty() ? 0_sg : _cdf.back();
+        }
+
+        bound_t getBound(const transform &trans) const override {
+            return _bound.transform(trans);
+        }
+
+        bool isHit(const ray &r, const transform &o2w) const override {
+            single scale;
+            return _aggregate.isHit(ToObjectRay(r, o2w, &scale));
+        }
+
+        bool tryHit(ray &r, const transform &o2w, surface_interaction *res) const override {
+            single scale;
+            ray local = ToObjectRay(r, o2w, &scale);
+            interaction i;
+            if (!_aggregate.tryHit(local, &i))
+                return false;
+
+            r.setT(local.getT() / scale);
+            *res = i.surface;
+            surface_helper::ResToWorldSpace(o2w, res);
+            return true;
+        }
+
+        bool canSample() const override { return !_cdf.empty(); }
+
+        /// @brief a triangle is chosen by its area, and then sampled by the remapped `u`
+        void sample(const transform &o2w, const vec2f &u, surface_sample *res) const override {
+            igiassert(!_cdf.empty());
+
+            const single x     = u[0] * _cdf.back();
+            const size_t index = std::min<size_t>(std::upper_bound(_cdf.begin(), _cdf.end(), x) - _cdf.begin(), _cdf.size() - 1);
+
+            const single lo   = index ? _cdf[index - 1] : 0_sg;
+            const single area = _cdf[index] - lo;
+
+            const entity &e = _triangles[index];
+            e.getSurface().sample(o2w, vec2f(std::min((x - lo) / area, OneMinusEpsilon), u[1]), res);
+            res->pdf *= area / _cdf.back();
+        }
+
+        const aggregate &getAggregate() const {
+            return _aggregate;
+        }
+
+      private:
+        static constexpr single OneMinusEpsilon = 1_sg - SingleEpsilon * .5_sg;
+
+        /// @brief the direction is normalized in object space as `surface_helper::ToLocalRay` does,
+        /// and the distance is scaled along, by `scale` which is the length of the transformed direction
+        static ray ToObjectRay(const ray &r, const transform &o2w, single *scale) {
+            const vec3f d = o2w.mulVecInv(r.getDirection());
+            *scale        = d.magnitude();
+            return ray(o2w.mulPosInv(r.getOrigin()), d * (1_sg / *scale), r.getT() * *scale);
+        }
+
+        static std::pmr::vector<entity> InitTriangles(const triangle_mesh &mesh) {
+            std::pmr::vector<entity> res(context::GetTypedAllocator<entity>());
+            res.reserve(mesh.end() - mesh.begin());
+
+            for (const triangle &t : mesh)
+                if (res.empty())
+                    res.emplace_back(&t);
+                else
+                    res.emplace_back(res.front().getTransform(), &t);
+            return res;
+        }
+    };
+}  // namespace igi
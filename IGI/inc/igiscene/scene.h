@@ -1,6 +1,7 @@
 ﻿#pragma once
 
 #include "igiscene/aggregate.h"
+#include "igiscene/instanced_mesh.h"
 #include "igiutilities/shared_vector.h"
 
 namespace igi {
@@ -9,6 +10,13 @@ namespace igi {
 
         std::shared_ptr<ISurface *[]> _surfaces;
 
+        std::shared_ptr<entity[]> _entities;
+
+        // entities of emissive materials whose surfaces can be sampled, which are sampled by next event estimation
+        std::shared_ptr<const entity *[]> _lights;
+
+        size_t _nlights;
+
         aggregate _aggregate;
 
         color3 _background;
@@ -20,6 +28,15 @@ namespace igi {
                     const serializer_t &eser = ser["entity"];
 
                     IGI_SERIALIZE_OPTIONAL(color3, background, palette::black, ser);
+                    IGI_SERIALIZE_OPTIONAL(unsigned, bvhWidth, aggregate_configuration::DefaultWidth, ser);
+                    IGI_SERIALIZE_OPTIONAL(bool, bvhQuantized, false, ser);
+                    IGI_SERIALIZE_OPTIONAL(unsigned, bvhBinCount, aggregate_configuration::DefaultBinCount, ser);
+                    IGI_SERIALIZE_OPTIONAL(unsigned, bvhBatchSize, aggregate_configuration::DefaultBatchSize, ser);
+                    IGI_SERIALIZE_OPTIONAL(single, bvhMinSplitRatio, aggregate_configuration::DefaultMinSplitRatio, ser);
+                    // "sbvh", "lbvh" or "hlbvh", see `aggregate_build_method`
+                    const std::string_view bvhBuilder = ser.HasMember("bvhBuilder") ? ser["bvhBuilder"].GetString() : "sbvh";
+                    // path of the file the tree is cached in, which is kept by the document until the aggregate is built
+                    const std::string_view bvhCache = ser.HasMember("bvhCache") ? ser["bvhCache"].GetString() : "";
 
                     constexpr auto policy = [](const serializer_t &ser) { return ser["type"].GetString(); };
 
@@ -27,19 +44,57 @@ namespace igi {
                     shared_vector<ISurface *> surfs = serialization::DeserializePmrArray<ISurface, shared_vector>(sser, policy);
                     shared_vector<entity> ents      = serialization::DeserializeArray<entity, shared_vector>(eser, mats, surfs);
 
+                    const aggregate_configuration config = aggregate_configuration()
+                                                               .setWidth(bvhWidth)
+                                                               .setQuantized(bvhQuantized)
+                                                               .setBinCount(bvhBinCount)
+                                                               .setBatchSize(bvhBatchSize)
+                                                               .setMinSplitRatio(bvhMinSplitRatio)
+                                                               .setBuildMethod(bvhBuilder == "lbvh"    ? aggregate_build_method::lbvh
+                                                                               : bvhBuilder == "hlbvh" ? aggregate_build_method::hlbvh
+                                                                                                       : aggregate_build_method::sbvh)
+                                                               .setCachePath(bvhCache);
+
                     return context::New<scene>(mats.as_shared_ptr(), surfs.as_shared_ptr(), ents.as_shared_ptr(),
-                                               ents.size(), background);
+                                               ents.size(), background, config);
                 }))
 
         scene(std::shared_ptr<IMaterial *[]> mats, std::shared_ptr<ISurface *[]> surfs,
-              std::shared_ptr<entity[]> entities, size_t nentities, const color3 &background)
-            : _materials(std::move(mats)), _surfaces(std::move(surfs)),
-              _aggregate(entities.get(), nentities), _background(background) { }
+              std::shared_ptr<entity[]> entities, size_t nentities, const color3 &background,
+              const aggregate_configuration &config = aggregate_configuration())
+            : _materials(std::move(mats)), _surfaces(std::move(surfs)), _entities(std::move(entities)), _nlights(0),
+              _aggregate(_entities.get(), nentities, config), _background(background) {
+            auto isLight = [&](size_t i) {
+                return _entities[i].getSurface().canSample() && _entities[i].getMaterial().getLuminance().brightness() > 0_col;
+            };
+
+            for (size_t i = 0; i < nentities; i++)
+                _nlights += isLight(i);
+
+            _lights = context::AllocateSharedArray<const entity *>(_nlights);
+            for (size_t i = 0, j = 0; i < nentities; i++)
+                if (isLight(i))
+                    _lights[j++] = &_entities[i];
+        }
 
         const aggregate &getAggregate() const {
             return _aggregate;
         }
 
+        /// @brief entities moved through their transforms are expected to be refitted before rendering, see `aggregate::refit`
+        aggregate &getAggregate() {
+            return _aggregate;
+        }
+
+        size_t getLightCount() const {
+            return _nlights;
+        }
+
+        const entity &getLight(size_t index) const {
+            igiassert(index < _nlights);
+            return *_lights[index];
+        }
+
         color3 getBackground() const {
             return _background;
         }
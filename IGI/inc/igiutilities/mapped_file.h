@@ -0,0 +1,57 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <string_view>
+#include <utility>
+
+namespace igi {
+    /// @brief whole file mapped into memory for reading, which is not open if the file is missing or empty
+    class mapped_file {
+        const std::byte *_data = nullptr;
+        size_t _size           = 0;
+#ifdef _WIN32
+        void *_file = nullptr, *_mapping = nullptr;
+#endif
+
+      public:
+        mapped_file() = default;
+
+        explicit mapped_file(std::string_view path);
+
+        mapped_file(const mapped_file &) = delete;
+
+        mapped_file(mapped_file &&o) noexcept {
+            swap(o);
+        }
+
+        mapped_file &operator=(const mapped_file &) = delete;
+
+        mapped_file &operator=(mapped_file &&o) noexcept {
+            mapped_file(std::move(o)).swap(*this);
+            return *this;
+        }
+
+        ~mapped_file();
+
+        bool isOpen() const {
+            return _data;
+        }
+
+        const std::byte *getData() const {
+            return _data;
+        }
+
+        size_t getSize() const {
+            return _size;
+        }
+
+        void swap(mapped_file &o) noexcept {
+            std::swap(_data, o._data);
+            std::swap(_size, o._size);
+#ifdef _WIN32
+            std::swap(_file, o._file);
+            std::swap(_mapping, o._mapping);
+#endif
+        }
+    };
+}  // namespace igi
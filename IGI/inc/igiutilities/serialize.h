@@ -56,7 +56,9 @@ namespace igi {
                         }));
             }
             else {
-                if constexpr (std::is_same_v<T, int>)
+                if constexpr (std::is_same_v<T, bool>)
+                    return ser.GetBool();
+                else if constexpr (std::is_same_v<T, int>)
                     return ser.GetInt();
                 else if constexpr (std::is_same_v<T, unsigned>)
                     return ser.GetUint();
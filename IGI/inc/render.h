@@ -2,6 +2,7 @@
 
 #include <chrono>
 #include <memory_resource>
+#include <mutex>
 #include <ostream>
 #include "igiacceleration/parallel.h"
 #include "igicamera/camera.h"
@@ -10,65 +11,192 @@
 #include "igitexture/texture.h"
 
 namespace igi {
+    /// @brief per-worker state of render, which outlives a single render() call
+    struct render_tile_context {
+        integrator_context ic;
+
+        std::pmr::vector<color3> tile;
+
+        render_tile_context() : ic(), tile(context::GetTypedAllocator<color3>()) { }
+
+        void reset() {
+            ic.reset();
+        }
+    };
+
+    using render_parallel_t = parallel_context<render_tile_context>;
+
+    class render_configuration {
+        size_t _spp = 1;
+
+        size_t _tileSize = DefaultTileSize;
+
+        std::ostream *_log = nullptr;
+
+        render_parallel_t *_parallel = nullptr;
+
+      public:
+        static constexpr size_t DefaultTileSize = 16;
+
+        constexpr render_configuration(size_t spp = 1, std::ostream *log = nullptr)
+            : _spp(spp), _log(log) { }
+
+        constexpr render_configuration &setSpp(size_t spp) {
+            return _spp = spp, *this;
+        }
+
+        /// @param tileSize is expected to be power of two, so that a tile is fully covered by z-order curve
+        constexpr render_configuration &setTileSize(size_t tileSize) {
+            return _tileSize = tileSize, *this;
+        }
+
+        constexpr render_configuration &setLog(std::ostream *log) {
+            return _log = log, *this;
+        }
+
+        /// @param parallel workers and contexts borrowed by render(), otherwise a default one is shared by all calls without it,
+        /// which is locked by a call until it's done. callers rendering concurrently are expected to bring their own
+        constexpr render_configuration &setParallel(render_parallel_t *parallel) {
+            return _parallel = parallel, *this;
+        }
+
+        constexpr size_t getSpp() const { return _spp; }
+
+        constexpr size_t getTileSize() const { return _tileSize; }
+
+        constexpr std::ostream *getLog() const { return _log; }
+
+        /// @param lock takes the lock of the default context if it's the one returned, which is expected to be held while it's used
+        render_parallel_t &getParallel(std::unique_lock<std::mutex> *lock) const {
+            if (_parallel)
+                return *_parallel;
+
+            static render_parallel_t Default;
+            static std::mutex DefaultMutex;
+            *lock = std::unique_lock<std::mutex>(DefaultMutex);
+            return Default;
+        }
+    };
+
+    /// @brief a task renders a whole tile, whose pixels are traversed in z-order into a buffer owned by the worker,
+    /// and the buffer is written to `res` once the tile is done
     template <typename TCamera, typename TIntegrator>
     void render(const scene &scene, TCamera &&camera, TIntegrator &&integrator,
-                texture_rgb &res, size_t spp = 1, std::ostream *log = nullptr) {
+                texture_rgb &res, const render_configuration &config) {
+        const size_t spp = config.getSpp(), tileSize = config.getTileSize();
         igiassert(spp > 0);
+        igiassert(tileSize > 0 && !(tileSize & (tileSize - 1)), "tile size is expected to be power of two");
+
+        const size_t w = res.getWidth(), h = res.getHeight();
 
-        const single w = res.getWidth(), h = res.getHeight();
-        const single wInv = 1_sg / w, hInv = 1_sg / h, sppInv = 1_sg / spp;
-        parallel_context parallel([&]() {
-            return std::make_tuple(integrator_context(),
-                                   uniform_quad_distribution(vec2f::One(0_sg), vec2f(wInv, hInv)),
-                                   std::ref(camera), std::ref(integrator), std::ref(scene), spp, sppInv);
+        struct frame_t {
+            const igi::scene &scene;
+            std::remove_reference_t<TCamera> &camera;
+            std::remove_reference_t<TIntegrator> &integrator;
+            texture_rgb &res;
+            size_t spp, tileSize;
+            single sppInv;
+            vec2f sizeInv;
+        } const frame { scene, camera, integrator, res, spp, tileSize, 1_sg / spp, vec2f(1_sg / w, 1_sg / h) };
+
+        // tiles are sized here rather than by tasks, since the allocator they draw from isn't meant for concurrent use
+        std::unique_lock<std::mutex> lock;
+        render_parallel_t &parallel = config.getParallel(&lock);
+        parallel.forEachContext([tileSize](render_tile_context &context) {
+            context.tile.resize(tileSize * tileSize);
         });
-        auto job = parallel.schedule([](auto &context, vec2f uv, color3 *res) {
-            auto &[ic, uqd, camera, integrator, scene, spp, sppInv] = context;
 
-            ray ray;
+        auto job = parallel.schedule([](auto &context, const frame_t *frame, vec2u origin) {
+            auto &[ic, tile] = context;
+            const auto &[scene, camera, integrator, res, spp, tileSize, sppInv, sizeInv] = *frame;
+
+            const unsigned tileW = std::min<unsigned>(tileSize, res.getWidth() - origin[0]);
+            const unsigned tileH = std::min<unsigned>(tileSize, res.getHeight() - origin[1]);
+
+            uniform_quad_distribution uqd(vec2f::One(0_sg), sizeInv);
+
+            // primary rays of neighbouring samples are coherent, thus they are traced as packets,
+            // and the integrator carries on from their hits if it can
+            ray_packet packet;
+            interaction hits[ray_packet::Size];
+            vec2f samples[ray_packet::Size];
+            color3 *pixels[ray_packet::Size];
+            single weights[ray_packet::Size];
+            size_t n = 0;
+
+            auto flush = [&]() {
+                if (integrator.canIntegrateHit()) {
+                    camera.getRays(samples, n, &packet);
+                    const unsigned hit = scene.getAggregate().tryHit(packet, hits, ic.itrtmp);
+                    for (size_t lane = 0; lane < n; lane++) {
+                        const interaction *h = hit & (1u << lane) ? hits + lane : nullptr;
+                        *pixels[lane] += integrator.integrateHit(scene, packet[lane], h, ic) * weights[lane];
+                    }
+                } else {
+                    for (size_t lane = 0; lane < n; lane++) {
+                        ray r = camera.getRay(samples[lane]);
+                        *pixels[lane] += integrator.integrate(scene, r, ic) * weights[lane];
+                    }
+                }
+                n = 0;
+            };
+
             single p;
-            vec2f sample;
 
-            for (size_t i = 0; i < spp; i++) {
-                sample = uqd(ic.pcg, &p) + uv;
-                ray    = camera.getRay(sample);
-                *res += (integrator.integrate(scene, ray, ic) / p) * sppInv;
+            mvec<2, unsigned> morton;
+            for (size_t i = 0; i < tileSize * tileSize; i++, ++morton) {
+                const vec2u &local = morton.coord();
+                if (local[0] >= tileW || local[1] >= tileH)
+                    continue;
+
+                const vec2f uv = Scale(vec2f(origin + local), sizeInv);
+
+                color3 &pixel = tile[local[1] * tileSize + local[0]];
+                pixel         = palette::black;
+                for (size_t j = 0; j < spp; j++) {
+                    samples[n] = uqd(ic.pcg, &p) + uv;
+                    pixels[n]  = &pixel;
+                    weights[n] = sppInv / p;
+                    if (++n == ray_packet::Size)
+                        flush();
+                }
             }
+            if (n)
+                flush();
+
+            for (unsigned v = 0; v < tileH; v++)
+                std::copy_n(&tile[v * tileSize], tileW, &res.at(origin[0], origin[1] + v));
+
+            // scratch of integrators and surfaces is per path, none of which outlives the tile
+            context::ResetThreadTemp();
         });
 
-        const size_t total  = res.getHeight() * res.getWidth() * spp;
-        const size_t oneper = total / 100, modulo = total % 100;
-        size_t issued = 1, percent = 0, residue = 0;
+        const size_t ntileX = (w + tileSize - 1) / tileSize;
+        const size_t ntileY = (h + tileSize - 1) / tileSize;
+        const size_t total  = ntileX * ntileY;
 
-        static constexpr size_t BlockSize     = 16;
-        static constexpr size_t PixelPerBlock = BlockSize * BlockSize;
+        std::ostream *const log = config.getLog();
+        size_t issued = 0, percent = 0;
 
-        res.clear(palette::black);
         const auto start = std::chrono::high_resolution_clock::now();
-        auto issue       = [&](vec2u uv) {
-            job.issue(vec2f(uv), &res.at(uv[0], uv[1]));
+        for (size_t v = 0; v < ntileY; v++)
+            for (size_t u = 0; u < ntileX; u++) {
+                job.issue(&frame, vec2u(u * tileSize, v * tileSize));
 
-            if (log && ++issued > oneper) {
-                const auto elapsed = std::chrono::high_resolution_clock::now() - start;
-                const auto ns      = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed);
+                if (log && (++issued * 100) / total > percent) {
+                    const auto elapsed = std::chrono::high_resolution_clock::now() - start;
+                    const auto ns      = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed);
 
-                *log << ++percent << "%\t" << ns.count() * 1e-9 << "s\n";
-                issued = (residue += modulo) > 100 ? (residue -= 100, 0) : 1;
-            }
-        };
-        for (size_t v = 0, u = 0; v < h; u = 0) {
-            if (v + BlockSize < h)
-                for (; u + BlockSize < w; u += BlockSize) {
-                    mvec<2, unsigned> morton;
-                    for (size_t i = 0; i < PixelPerBlock; i++, ++morton)
-                        issue(vec2u(u, v) + morton.coord());
+                    percent = issued * 100 / total;
+                    *log << percent << "%\t" << ns.count() * 1e-9 << "s\n";
                 }
-
-            const size_t bottom = v + BlockSize < h ? v + BlockSize : h;
-            for (; v < bottom; v++)
-                for (size_t i = u; i < w; i++)
-                    issue(vec2u(i, v));
-        }
+            }
         job.finish();
     }
+
+    template <typename TCamera, typename TIntegrator>
+    void render(const scene &scene, TCamera &&camera, TIntegrator &&integrator,
+                texture_rgb &res, size_t spp = 1, std::ostream *log = nullptr) {
+        render(scene, std::forward<TCamera>(camera), std::forward<TIntegrator>(integrator), res, render_configuration(spp, log));
+    }
 }  // namespace igi
@@ -1,25 +1,56 @@
 ﻿#include "igigeometry/cylinder.h"
 
-bool igi::cylinder::isHit(const ray &wr, const transform &trans) const {
-    ray r = surface_helper::ToLocalRay(wr, trans);
+bool igi::cylinder::isHit(const ray &r, const transform &trans) const {
+    return isHit(r, compact_affine(trans.getInv()));
+}
+
+bool igi::cylinder::tryHit(ray &r, const transform &trans, surface_interaction *res) const {
+    if (!tryHit(r, compact_affine(trans.getInv()), res))
+        return false;
+
+    surface_helper::ResToWorldSpace(trans, res);
+    return true;
+}
+
+// the ray is brought to object space without normalization, thus distances along it are kept
+bool igi::cylinder::isHit(const ray &wr, const compact_affine &w2o) const {
+    const vec3f o = w2o.mulPos(wr.getOrigin());
+    const vec3f d = w2o.mulVec(wr.getDirection());
 
-    single zmin = r.getOrigin()[2], zmax = r.getEndpoint()[2];
+    single zmin = o[2], zmax = o[2] + d[2] * static_cast<single>(wr.getT());
     if (zmax < zmin)
         std::swap(zmax, zmin);
     if (!Overlapcf(zmin, zmax, _zMin, _zMax))
         return false;
 
-    vec2f oxy = static_cast<vec2f>(r.getOrigin());
-    vec2f dxy = static_cast<vec2f>(r.getDirection());
-    single p  = -Dot(oxy, dxy);
-    return (oxy + dxy * p).magnitudeSqr() < _r * _r;
+    vec2f oxy(o);
+    vec2f dxy(d);
+
+    auto [solved, t0, t1] = Quadratic(esingle(Dot(dxy, dxy)), esingle(Dot(oxy, dxy) * 2_sg), esingle(Dot(oxy, oxy) - _r * _r));
+    if (!solved)
+        return false;
+
+    const single &oz = o[2];
+    const single &dz = d[2];
+    return (wr.occluded(t0) && InRangecf(_zMin, _zMax, oz + dz * t0))
+           || (wr.occluded(t1) && InRangecf(_zMin, _zMax, oz + dz * t1));
 }
 
-bool igi::cylinder::tryHit(ray &wr, const transform &trans, surface_interaction *res) const {
-    const ray r = surface_helper::ToLocalRay(wr, trans);
+bool igi::cylinder::tryHit(ray &wr, const compact_affine &w2o, surface_interaction *res) const {
+    surface_hit hit;
+    if (!tryHit(wr, w2o, &hit))
+        return false;
+
+    computeInteraction(wr, w2o, hit, res);
+    return true;
+}
+
+bool igi::cylinder::tryHit(ray &wr, const compact_affine &w2o, surface_hit *hit) const {
+    const vec3f o = w2o.mulPos(wr.getOrigin());
+    const vec3f d = w2o.mulVec(wr.getDirection());
 
-    vec2f oxy(r.getOrigin());
-    vec2f dxy(r.getDirection());
+    vec2f oxy(o);
+    vec2f dxy(d);
 
     esingle a = Dot(dxy, dxy);
     esingle b = Dot(oxy, dxy) * 2_sg;
@@ -29,8 +60,8 @@ bool igi::cylinder::tryHit(ray &wr, const transform &trans, surface_interaction
     if (!solved)
         return false;
 
-    const single &oz = r.getOrigin()[2];
-    const single &dz = r.getDirection()[2];
+    const single &oz = o[2];
+    const single &dz = d[2];
     esingle t;
     if (wr.occluded(t0) && InRangecf(_zMin, _zMax, oz + dz * t0))
         t = t0;
@@ -40,7 +71,12 @@ bool igi::cylinder::tryHit(ray &wr, const transform &trans, surface_interaction
         return false;
 
     wr.setT(t);
-    res->position = r.cast(t);
+    hit->coords = d * static_cast<single>(t) + o;
+    return true;
+}
+
+void igi::cylinder::computeInteraction(const ray &wr, const compact_affine &w2o, const surface_hit &hit, surface_interaction *res) const {
+    res->position = hit.coords;
 
     res->normal = vec3f(res->position.row<0, 1>(), 0_sg);
 
@@ -50,8 +86,14 @@ bool igi::cylinder::tryHit(ray &wr, const transform &trans, surface_interaction
     res->dpdu = vec3f(-res->position[1], res->position[0], 0_sg);
     res->dpdv = vec3f(0_sg, 0_sg, _zMax - _zMin);
 
-    res->normal = MakeReversedOrient(r.getDirection(), res->normal);
+    res->normal = MakeReversedOrient(w2o.mulVec(wr.getDirection()), res->normal);
+}
+
+void igi::cylinder::sample(const transform &trans, const vec2f &u, surface_sample *res) const {
+    const single phi = PiTwo * u[1];
+    const vec3f n(std::cos(phi), std::sin(phi), 0_sg);
 
-    surface_helper::ResToWorldSpace(trans, res);
-    return true;
+    res->position = trans.mulPos(vec3f(n[0] * _r, n[1] * _r, _zMin + (_zMax - _zMin) * u[0]));
+    res->normal   = trans.mulNormal(n).normalized();
+    res->pdf      = 1_sg / (getArea() * surface_helper::GetAreaScale(trans, n));
 }
@@ -1,19 +1,50 @@
 ﻿#include "igigeometry/sphere.h"
 
 namespace igi {
-    bool sphere::isHit(const ray &wr, const transform &trans) const {
-        const ray r = surface_helper::ToLocalRay(wr, trans);
-        single p    = -Dot(r.getOrigin(), r.getDirection());
-        return r.cast(p).magnitudeSqr() < _r * _r
-               && p < r.getT() * r.getDirection().magnitudeSqr();
+    bool sphere::isHit(const ray &r, const transform &trans) const {
+        return isHit(r, compact_affine(trans.getInv()));
     }
 
-    bool sphere::tryHit(ray &wr, const transform &o2w, surface_interaction *res) const {
-        const ray r = surface_helper::ToLocalRay(wr, o2w);
+    bool sphere::tryHit(ray &r, const transform &o2w, surface_interaction *res) const {
+        if (!tryHit(r, compact_affine(o2w.getInv()), res))
+            return false;
+
+        surface_helper::ResToWorldSpace(o2w, res);
+        return true;
+    }
+
+    // the ray is brought to object space without normalization, thus distances along it are kept
+    bool sphere::isHit(const ray &wr, const compact_affine &w2o) const {
+        const vec3f o = w2o.mulPos(wr.getOrigin());
+        const vec3f d = w2o.mulVec(wr.getDirection());
+
+        const single a    = d.magnitudeSqr();
+        const single b    = Dot(d, o);
+        const single c    = o.magnitudeSqr() - _r * _r;
+        const single disc = b * b - a * c;
+        if (!(disc > 0_sg))
+            return false;
+
+        const single s = std::sqrt(disc);
+        return wr.occluded(esingle((-b - s) / a)) || wr.occluded(esingle((-b + s) / a));
+    }
+
+    bool sphere::tryHit(ray &wr, const compact_affine &w2o, surface_interaction *res) const {
+        surface_hit hit;
+        if (!tryHit(wr, w2o, &hit))
+            return false;
 
-        esingle a = r.getDirection().magnitudeSqr();
-        esingle b = 2_sg * Dot(r.getDirection(), r.getOrigin());
-        esingle c = r.getOrigin().magnitudeSqr() - _r * _r;
+        computeInteraction(wr, w2o, hit, res);
+        return true;
+    }
+
+    bool sphere::tryHit(ray &wr, const compact_affine &w2o, surface_hit *hit) const {
+        const vec3f o   = w2o.mulPos(wr.getOrigin());
+        const vec3f dir = w2o.mulVec(wr.getDirection());
+
+        esingle a = dir.magnitudeSqr();
+        esingle b = 2_sg * Dot(dir, o);
+        esingle c = o.magnitudeSqr() - _r * _r;
         esingle d = b * b - 4_sg * a * c;
 
         if (!(d > 0)) return false;
@@ -31,7 +62,12 @@ namespace igi {
             return false;
 
         wr.setT(t);
-        res->position = r.cast(t);
+        hit->coords = dir * static_cast<single>(t) + o;
+        return true;
+    }
+
+    void sphere::computeInteraction(const ray &wr, const compact_affine &w2o, const surface_hit &hit, surface_interaction *res) const {
+        res->position = hit.coords;
         res->normal   = res->position.normalized();
 
         vec2f xy(res->normal);
@@ -45,9 +81,17 @@ namespace igi {
         res->dpdu = vec3f(cosv * cosu * _r, sinv * cosu * _r, -sinu * _r);
         res->dpdv = vec3f(-sinv * sinu * _r, cosv * sinu * _r, 0_sg);
 
-        res->normal = MakeReversedOrient(r.getDirection(), res->normal);
+        res->normal = MakeReversedOrient(w2o.mulVec(wr.getDirection()), res->normal);
+    }
 
-        surface_helper::ResToWorldSpace(o2w, res);
-        return true;
+    void sphere::sample(const transform &trans, const vec2f &u, surface_sample *res) const {
+        const single z   = 1_sg - 2_sg * u[0];
+        const single rxy = std::sqrt(std::max(0_sg, 1_sg - z * z));
+        const single phi = PiTwo * u[1];
+        const vec3f n(rxy * std::cos(phi), rxy * std::sin(phi), z);
+
+        res->position = trans.mulPos(n * _r);
+        res->normal   = trans.mulNormal(n).normalized();
+        res->pdf      = 1_sg / (getArea() * surface_helper::GetAreaScale(trans, n));
     }
 }  // namespace igi
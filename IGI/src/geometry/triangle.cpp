@@ -1,10 +1,14 @@
 ﻿#include "igigeometry/triangle.h"
 
 template <typename T, size_t Depth = 1>
-bool tryHitTriangle(const igi::triangle &t, igi::ray &r, const igi::transform &trans, igi::surface_interaction *res);
+bool tryHitTriangle(igi::ray &r, const igi::triangle_vertices &world, igi::surface_hit *hit);
 
 bool igi::triangle::isHit(const ray &r, const transform &trans) const {
-    const auto &[a, b, c] = getPos();
+    return isHit(r, getVertices(trans));
+}
+
+bool igi::triangle::isHit(const ray &r, const triangle_vertices &world) const {
+    const auto &[a, b, c] = world.positions;
 
     vec3f ra = r.toRaySpace(a);
     vec3f rb = r.toRaySpace(b);
@@ -45,11 +49,117 @@ bool igi::triangle::isHit(const ray &r, const transform &trans) const {
 }
 
 bool igi::triangle::tryHit(ray &r, const transform &trans, surface_interaction *res) const {
-    return tryHitTriangle<single>(*this, r, trans, res);
+    return tryHit(r, getVertices(trans), res);
+}
+
+bool igi::triangle::tryHit(ray &r, const triangle_vertices &world, surface_interaction *res) const {
+    surface_hit hit;
+    if (!tryHit(r, world, &hit))
+        return false;
+
+    computeInteraction(r, world, hit, res);
+    return true;
+}
+
+bool igi::triangle::tryHit(ray &r, const triangle_vertices &world, surface_hit *hit) const {
+    return tryHitTriangle<single>(r, world, hit);
+}
+
+void igi::triangle::computeInteraction(const ray &, const triangle_vertices &world, const surface_hit &hit, surface_interaction *res) const {
+    const auto &[a, b, c] = world.positions;
+    const single u = hit.coords[0], v = hit.coords[1], w = hit.coords[2];
+
+    res->position = a * u + b * v + c * w;
+
+    auto [uv0, uv1, uv2] = getUV();
+
+    res->uv = uv0 * u + uv1 * v + uv2 * w;
+
+    // (...).rows() : Returns a tuple encapsulating two vec3f's
+    //   |
+    //   |- (...).inverse() * (...) : Multiply matrix and a vector of vector
+    //        |                 |- igivec(b - a, c - a) : Construct a vector of vector
+    //        |
+    //        |- mat2x2f(uv1 - uv0, uv2 - uv0) : Construct matrix from two column vectors
+    std::tie(res->dpdu, res->dpdv) = mat2x2f(uv1 - uv0, uv2 - uv0).inverse().operator*(igivec(b - a, c - a)).row();
+
+    res->normal = Cross(res->dpdu, res->dpdv).normalized();
 }
 
+igi::bound_t igi::triangle::getClippedBound(const transform &trans, const bound_t &box) const {
+    // a plane adds one vertex at most to a convex polygon
+    static constexpr size_t MaxVertexCount = 3 + 6;
+    // relative error of points interpolated on edges
+    static constexpr single ErrorFactor = 8_sg * SingleEpsilon;
+
+    const triangle_vertices world = getVertices(trans);
+
+    vec3f polygons[2][MaxVertexCount];
+    size_t n = 3;
+    std::copy_n(world.positions, 3, polygons[0]);
+
+    vec3f magnitude;
+    for (size_t i = 0; i < 3; i++)
+        magnitude[i] = std::max({ Abs(world.positions[0][i]), Abs(world.positions[1][i]), Abs(world.positions[2][i]) });
+
+    vec3f *src = polygons[0], *dst = polygons[1];
+    for (size_t plane = 0; plane < 6; plane++) {
+        const size_t dim    = plane >> 1;
+        const bool upper    = plane & 1;
+        const single coord  = upper ? box.getMax(dim) : box.getMin(dim);
+        const auto isInside = [&](const vec3f &p) { return upper ? p[dim] <= coord : coord <= p[dim]; };
+
+        size_t m = 0;
+        for (size_t i = 0; i < n; i++) {
+            const vec3f &p = src[i];
+            const vec3f &q = src[i + 1 == n ? 0 : i + 1];
+
+            const bool pInside = isInside(p);
+            if (pInside)
+                dst[m++] = p;
+            if (pInside != isInside(q)) {
+                vec3f &x = dst[m++];
+                x        = p + (q - p) * ((coord - p[dim]) / (q[dim] - p[dim]));
+                x[dim]   = coord;
+            }
+        }
+
+        if (!m)
+            return bound_t::NegInf();
+
+        n = m;
+        std::swap(src, dst);
+    }
+
+    bound_t res(src[0], src[0]);
+    for (size_t i = 1; i < n; i++)
+        res.extend(src[i]);
+
+    // the polygon left is rounded, which is compensated before being cut by the box again
+    const vec3f error = magnitude * ErrorFactor;
+    return bound_t(res.getMin() - error, res.getMax() + error).intersect(box);
+}
+
+void igi::triangle::sample(const transform &trans, const vec2f &u, surface_sample *res) const {
+    const triangle_vertices world = getVertices(trans);
+    const auto &[wa, wb, wc]      = world.positions;
+
+    // uniform barycentric coordinates by square root warping
+    const single su = std::sqrt(u[0]);
+    const single u0 = 1_sg - su;
+    const single u1 = u[1] * su;
+
+    const vec3f n      = Cross(wb - wa, wc - wa);
+    const single area2 = n.magnitude();
+
+    res->position = wa * u0 + wb * u1 + wc * (1_sg - u0 - u1);
+    res->normal   = n * (1_sg / area2);
+    res->pdf      = 2_sg / area2;
+}
+
+/// vertices are in world space, only barycentric coordinates are recorded
 template <typename T, size_t Depth>
-bool tryHitTriangle(const igi::triangle &t, igi::ray &r, const igi::transform &trans, igi::surface_interaction *res) {
+bool tryHitTriangle(igi::ray &r, const igi::triangle_vertices &world, igi::surface_hit *hit) {
     using precise = igi::precise_float_t<T>;
     using single  = T;
     using esingle = igi::error_single<T>;
@@ -62,16 +172,16 @@ bool tryHitTriangle(const igi::triangle &t, igi::ray &r, const igi::transform &t
 
     auto preciseHit = [&]() {
         if constexpr (TryPrecise)
-            return tryHitTriangle<precise, Depth - 1>(t, r, trans, res);
+            return tryHitTriangle<precise, Depth - 1>(r, world, hit);
         else
             return false;
     };
 
-    const auto &[a, b, c] = t.getPos();
+    const auto &[a, b, c] = world.positions;
 
-    const vec3ef ra(r.toRaySpace(trans.mulPos(a)));
-    const vec3ef rb(r.toRaySpace(trans.mulPos(b)));
-    const vec3ef rc(r.toRaySpace(trans.mulPos(c)));
+    const vec3ef ra(r.toRaySpace(a));
+    const vec3ef rb(r.toRaySpace(b));
+    const vec3ef rc(r.toRaySpace(c));
 
     const vec2ef ra2(ra);
     const vec2ef rb2(rb);
@@ -123,20 +233,6 @@ bool tryHitTriangle(const igi::triangle &t, igi::ray &r, const igi::transform &t
     const single w = a20 * detInv;
 
     r.setT(static_cast<igi::esingle>(zsum * detInv));
-    res->position = igi::vec3f(a * u + b * v + c * w);
-
-    auto [uv0, uv1, uv2] = t.getUV();
-
-    res->uv = igi::vec2f(uv0 * u + uv1 * v + uv2 * w);
-
-    // (...).rows() : Returns a tuple encapsulating two vec3f's
-    //   |
-    //   |- (...).inverse() * (...) : Multiply matrix and a vector of vector
-    //        |                 |- igivec(b - a, c - a) : Construct a vector of vector
-    //        |
-    //        |- mat2x2f(uv1 - uv0, uv2 - uv0) : Construct matrix from two column vectors
-    std::tie(res->dpdu, res->dpdv) = igi::mat2x2f(uv1 - uv0, uv2 - uv0).inverse().operator*(igivec(b - a, c - a)).row();
-
-    res->normal = Cross(res->dpdu, res->dpdv).normalized();
+    hit->coords = igi::vec3f(u, v, w);
     return true;
 }
@@ -1,16 +1,22 @@
 ﻿#include "igiintegrator/path_trace.h"
 
+igi::vec3f igi::path_trace::OffsetOrigin(const vec3f &p, const vec3f &n, const vec3f &d) {
+    const single offset = GetOriginError(p);
+    return p + n * (Dot(d, n) < 0_sg ? -offset : offset);
+}
+
 igi::color3 igi::path_trace::integrate_impl(const scene &scene, const vec3f &o, const interaction &interaction,
-                                            size_t depth, integrator_context &context) const {
+                                            size_t depth, bool emitted, integrator_context &context) const {
     std::uniform_real_distribution<single> urd;
 
     const surface_interaction &surf = interaction.surface;
     const igi::IMaterial &mat       = *interaction.material;
 
-    const color3 lu = mat.getLuminance() * -Dot(o, surf.normal);
+    const color3 lu      = emitted ? GetEmission(o, interaction) : palette::black;
+    const color3 ldirect = _nee ? sampleLight(scene, o, interaction, context) : palette::black;
 
     if (!depth)
-        return lu;
+        return lu + ldirect;
 
     const mat3x3f ns = surf.getNormalSpace();
 
@@ -28,22 +34,82 @@ igi::color3 igi::path_trace::integrate_impl(const scene &scene, const vec3f &o,
 
         bxdf = mat(o, scat.direction, surf.normal);
 
-        if (bxdf.brightness() < .005_sg) {
+        // the estimator without NEE is kept as it was, which halves dim samples and leaves the rejected ones out of the average
+        if (_nee) {
+            nsamp++;
+
+            const single survival = bxdf.brightness() / (scat.pdf * RouletteThreshold);
+            if (survival < 1_sg) {
+                if (!(urd(context.pcg) < survival))
+                    continue;
+                scat.pdf *= survival;
+            }
+        }
+        else if (bxdf.brightness() < .005_sg) {
             if (urd(context.pcg) < .5_sg)
                 continue;
             scat.pdf *= .5_sg;
         }
 
-        r = ray(surf.position, scat.direction);
+        r = ray(OffsetOrigin(surf.position, surf.normal, scat.direction), scat.direction);
         if (scene.getAggregate().tryHit(r, &ia, context.itrtmp)) {
             single weight = 1_sg / r.getT();
             weight        = weight * weight / scat.pdf;
 
-            lint = lint + integrate_impl(scene, scat.direction, ia, depth - 1, context) * bxdf * weight;
+            const bool iaEmitted = !_nee || !IsSampledLight(ia);
+            lint = lint + integrate_impl(scene, scat.direction, ia, depth - 1, iaEmitted, context) * bxdf * weight;
         }
 
-        nsamp++;
+        if (!_nee)
+            nsamp++;
     }
 
-    return nsamp ? lu + lint / nsamp : lu;
+    return nsamp ? lu + ldirect + lint / nsamp : lu + ldirect;
+}
+
+igi::color3 igi::path_trace::sampleLight(const scene &scene, const vec3f &o, const interaction &interaction,
+                                         integrator_context &context) const {
+    std::uniform_real_distribution<single> urd;
+
+    const size_t nlights = scene.getLightCount();
+    if (!nlights)
+        return palette::black;
+
+    // the entity interacted with may be picked as well, which is then left to the shadow ray,
+    // so that concave emitters are still lit by themselves
+    const entity &light = scene.getLight(std::min(static_cast<size_t>(urd(context.pcg) * nlights), nlights - 1));
+
+    surface_sample smp;
+    light.getSurface().sample(light.getTransform(), vec2f(urd(context.pcg), urd(context.pcg)), &smp);
+    if (!(smp.pdf > 0_sg))
+        return palette::black;
+
+    const surface_interaction &surf = interaction.surface;
+
+    const vec3f d        = smp.position - surf.position;
+    const single distSqr = d.magnitudeSqr();
+    if (!(distSqr > 0_sg))
+        return palette::black;
+
+    const vec3f dir       = d * (1_sg / std::sqrt(distSqr));
+    const single cosLight = Abs(Dot(dir, smp.normal));
+
+    const color3 bxdf = (*interaction.material)(o, dir, surf.normal);
+
+    // rolled before the shadow ray, which is the expensive part
+    const single survival = std::min(1_sg, bxdf.brightness() / RouletteThreshold);
+    if (!(urd(context.pcg) < survival))
+        return palette::black;
+
+    // both ends are pushed off their surfaces, so the shadow ray stops short of the light by its rounding error
+    // rather than by a fraction of the distance
+    const vec3f origin = OffsetOrigin(surf.position, surf.normal, dir);
+    const vec3f target = OffsetOrigin(smp.position, smp.normal, -dir);
+    if (scene.getAggregate().occluded(ray(origin, target - origin), 1_sg, context.itrtmp))
+        return palette::black;
+
+    // estimates the same integral as scattered rays do, i.e., luminance * cos / t^2 over solid angle,
+    // where solid angle is converted to area of the light by another cos / t^2
+    const single weight = cosLight * cosLight * nlights / (distSqr * distSqr * smp.pdf * survival);
+    return light.getMaterial().getLuminance() * bxdf * weight;
 }
@@ -1,11 +1,16 @@
 ﻿#include "igiscene/aggregate.h"
+#include "igiacceleration/thread_pool.h"
 #include "igigeometry/triangle.h"
 #include "igiutilities/igiassert.h"
 
-/// This implementation of Spatial-Split BVH doesn't fully comply with the original idea
-/// "Shrinking bounding box" procedure is omitted because it requires perplexing interface design
+/// This is an implementation of Spatial-Split BVH, references cut by a split are shrunk to bound
+/// only the part of their surfaces on each side, see `ISurface::getClippedBound`
 
-void igi::aggregate::initBuild(build_itr_queue_t iterations) {
+/// Nodes are expanded in breadth-first order. The top levels are expanded on the calling thread
+/// until there are enough independent subtrees, which are then built concurrently and appended in queue order,
+/// thus the tree and its node ordering don't depend on scheduling
+
+class igi::aggregate::builder {
     class sah {
         bound_t _bound;
         single _childSA, _boundSAInv;
@@ -52,7 +57,9 @@ void igi::aggregate::initBuild(build_itr_queue_t iterations) {
         std::pmr::vector<std::pair<leaf, bool>> _leaves;
 
       public:
-        split() : _leaves(context::GetTypedAllocator<std::pair<leaf, bool>>()) { }
+        split() { }
+
+        split(std::pmr::memory_resource *resource) : _leaves(resource) { }
 
         void add(const leaf &l, bool bl = false) {
             _leaves.emplace_back(l, bl);
@@ -75,24 +82,289 @@ void igi::aggregate::initBuild(build_itr_queue_t iterations) {
         }
     };
 
-    static constexpr size_t MaxBinCount   = 8;
-    static constexpr size_t MaxSplitCount = MaxBinCount - 1;
-    static constexpr size_t BatchSize     = 4;
-    static constexpr single MinSplitRatio = .01_sg;
+  public:
+    static constexpr size_t MaxSplitCount = aggregate_configuration::MaxBinCount - 1;
+
+  private:
+    std::pmr::vector<node> &_nodes;
+    std::pmr::vector<leaf> &_leaves;
+
+    const size_t _binCount;
+    const size_t _batchSize;
+    const single _splitSAThres;
+
+    // throughout the implementation, "bin" is mentioned as a abstract conception, rather than shown as a type
+
+    // sahBegins and sahEnds records leaves on right side and left side of splits
+    // e.g., all of the leaves that are on the left side of a given split "end" on the left side of the split
+    // thus, the leftmost and rightmost bins are accounted for only once
+    // sahBegins: not accounted | .. | .. |       ..
+    // sahEnds:        ..       | .. | .. | not accounted
+    sah _sahBegins[MaxSplitCount], _sahEnds[MaxSplitCount];
+    // split records leaves that are across the split for further cost evaluation
+    split _splits[MaxSplitCount];
+
+    std::pmr::vector<leaf> _tmpLeaves;
+
+  public:
+    /// @param resource allocates scratch memory of the builder, it's only used by the calling thread
+    builder(std::pmr::vector<node> &nodes, std::pmr::vector<leaf> &leaves, const aggregate_configuration &config,
+            single splitSAThres, std::pmr::memory_resource *resource)
+        : _nodes(nodes), _leaves(leaves), _binCount(config.getBinCount()), _batchSize(config.getBatchSize()),
+          _splitSAThres(splitSAThres), _tmpLeaves(resource) {
+        for (split &s : _splits)
+            new (&s) split(resource);
+    }
+
+    builder(const builder &) = delete;
+    builder(builder &&)      = delete;
+
+    static single GetSplitSAThres(const bound_t &rootBound, single minSplitRatio) {
+        return sah::getSA(rootBound) * minSplitRatio;
+    }
+
+    /// @brief expands nodes from `_nodes[nodeIndex]`, the i-th group of leaves in `iterations` belongs to `_nodes[nodeIndex + i]`
+    /// @param ngroups number of groups of leaves in `iterations`
+    /// @return number of groups left in `iterations`, which is either 0 or no less than `maxGroups`
+    size_t build(build_itr_queue_t &iterations, size_t &nodeIndex, size_t ngroups, size_t maxGroups = ~static_cast<size_t>(0)) {
+        while (ngroups && ngroups < maxGroups) {
+            const size_t nleaves = iterations.front().nleaves;
+            iterations.pop_front();
+            igiassert(nleaves > 1);
+            --ngroups;
+
+            // caculate the numbers of bins and splits
+            const size_t nbins   = nleaves > _binCount ? _binCount : nleaves;
+            const size_t nsplits = nbins - 1;
+
+            // calculate bound of current node
+            bound_t &nodeBound = _nodes[nodeIndex].bound;
+            igiassert(!nodeBound.isSingular());
+
+            // determine whether attmpt to split or not
+            const bool trySplit = sah::getSA(nodeBound) > _splitSAThres;
+
+            // select widest dimension of the bound
+            const vec3f diagonal      = nodeBound.getDiagonal();
+            const size_t maxDim       = MaxIcf(diagonal[0], diagonal[1], diagonal[2]);
+            const single interval     = diagonal[maxDim];
+            const single binSize      = interval / nbins;
+            const single binSizeInv   = nbins / interval;
+            const single nodeBoundMin = nodeBound.getMin(maxDim);
+
+            _nodes[nodeIndex].axis = static_cast<uint8_t>(maxDim);
+
+            // traverse over leaves with adding them to bins and splits
+            std::for_each_n(iterations.begin(), nleaves, [&](packed_leaf &l) {
+                const leaf &leaf         = l.leaf;
+                const bound_t &leafBound = leaf.bound;
+
+                const auto binLo = GetBinIndex(leafBound.getMin(maxDim), nodeBoundMin, binSizeInv, nbins);
+                const auto binHi = GetBinIndex(leafBound.getMax(maxDim), nodeBoundMin, binSizeInv, nbins);
+                igiassert(leafBound.getMin(maxDim) >= nodeBound.getMin(maxDim));
+                igiassert(leafBound.getMax(maxDim) <= nodeBound.getMax(maxDim));
+                igiassert(binLo <= binHi);
+                igiassert(InRangeClosecf(0, nbins - 1, binLo));
+                igiassert(InRangeClosecf(0, nbins - 1, binHi));
+
+                if (binLo)
+                    _sahBegins[binLo - 1].include(leafBound);
+                if (binHi < nbins - 1)
+                    _sahEnds[binHi].include(leafBound);
+
+                for (size_t i = binLo; i < binHi; i++)
+                    _splits[i].add(leaf);
+            });
+
+            // calculate bound of union of partial bounds by adding leaves to bins previously
+            _sahEnds[0].calculateSAInv();
+            _sahEnds[nsplits - 1].calculateSAInv();
+            for (size_t i = 1; i < nsplits; i++) {
+                _sahEnds[i].include(_sahEnds[i - 1]);
+                _sahBegins[nsplits - 1 - i].include(_sahBegins[nsplits - i]);
+            }
+
+            // estimate sah of leaves lying across splits
+            single minSAH         = SingleInf;
+            size_t bestSplitIndex = ~0;
+            {
+                // stores new leaves by split
+                std::pmr::vector<leaf> &leavesSplit = _tmpLeaves;
+
+                for (size_t i = 0; i < nsplits; i++) {
+                    split &split = _splits[i];
+                    if (!split.size())
+                        continue;
+
+                    sah &sahLeft  = _sahEnds[i];
+                    sah &sahRight = _sahBegins[i];
+
+                    const single splitCoord = (i + 1) * binSize + nodeBoundMin;
+
+                    single sahs[3];
+                    size_t sahIndex = ~0;
+                    for (auto &j : split) {
+                        leaf &leaf         = j.first;
+                        bound_t &leafBound = leaf.bound;
+                        bool &leafSide     = j.second;
+
+                        const sah left  = SahIfInclude(sahLeft, leaf.bound);
+                        const sah right = SahIfInclude(sahRight, leaf.bound);
+
+                        sahs[0] = left.getSAH() + sahRight.getSAH();
+                        sahs[1] = right.getSAH() + sahLeft.getSAH();
+
+                        // the reference is cut at the split and shrunk to the part of the surface on each side
+                        sah splitLeft, splitRight;
+                        bound_t boundLeft, boundRight;
+                        if (trySplit) {
+                            boundLeft = boundRight = leafBound;
+                            boundLeft.setMax(maxDim, splitCoord);
+                            boundRight.setMin(maxDim, splitCoord);
+                            Shrink(leaf, boundLeft);
+                            Shrink(leaf, boundRight);
+
+                            splitLeft  = SahIfInclude(sahLeft, boundLeft);
+                            splitRight = SahIfInclude(sahRight, boundRight);
+
+                            sahs[2] = splitLeft.getSAH() + splitRight.getSAH();
+                        }
+                        else
+                            sahs[2] = 0_sg;
+
+                        sahIndex = MinIcf(sahs[0], sahs[1], sahs[2]);
+                        switch (sahIndex) {
+                            case 0:
+                                sahLeft  = left;
+                                leafSide = false;
+                                break;
+                            case 1:
+                                sahRight = right;
+                                leafSide = true;
+                                break;
+                            default:
+                                igiassert(trySplit);
+                                leavesSplit.push_back(leaf);
+
+                                sahLeft   = splitLeft;
+                                leafSide  = false;
+                                leafBound = boundLeft;
+
+                                sahRight                 = splitRight;
+                                leavesSplit.back().bound = boundRight;
+                                break;
+                        }
+                    }
+                    igiassert(sahIndex != ~0);
+
+                    if (minSAH > sahs[sahIndex]) {
+                        bestSplitIndex = i;
+                        minSAH         = sahs[sahIndex];
+
+                        for (leaf &j : leavesSplit)
+                            split.add(j, true);
+                    }
+
+                    leavesSplit.clear();
+                }
+            }
+            igiassert(bestSplitIndex != ~0);
+
+            // group leaves of left and right children nodes for next recursion
+            {
+                std::pmr::vector<leaf> &leavesRight = _tmpLeaves;
+
+                const single splitCoord = (bestSplitIndex + 1) * binSize + nodeBoundMin;
+
+                // emplace the number of leaves on the left side
+                const size_t leftChildrenIndex = iterations.size() - nleaves;
+                iterations.emplace_back(0);
+
+                size_t nleft = 0;
+                for (size_t i = 0; i < nleaves; i++) {
+                    const leaf &leaf = iterations.front().leaf;
+                    iterations.pop_front();
 
-    constexpr auto getBinIndex = [](single coord, single origin, single binSizeInv, size_t maxBinCount) {
+                    if (leaf.bound.getMax(maxDim) < splitCoord) {
+                        iterations.emplace_back(leaf);
+                        nleft++;
+                    }
+                    else if (splitCoord < leaf.bound.getMin(maxDim))
+                        leavesRight.emplace_back(leaf);
+                }
+
+                split &bestSplit = _splits[bestSplitIndex];
+                for (auto &i : bestSplit) {
+                    if (i.second)
+                        leavesRight.emplace_back(i.first);
+                    else {
+                        iterations.emplace_back(i.first);
+                        nleft++;
+                    }
+                }
+
+                // if there is only one leaf as child, store it directly
+                igiassert(nleft);
+                if (nleft < _batchSize) {
+                    setNodeChildLeaf(nodeIndex, iterations.end() - nleft, nleft, 0);
+                    iterations.pop_back(nleft + 1);
+                }
+                else {
+                    iterations[leftChildrenIndex].nleaves = nleft;
+
+                    setNodeChildNode(nodeIndex, _sahEnds[bestSplitIndex].getBound(), 0);
+                    ++ngroups;
+                }
+
+                igiassert(!leavesRight.empty());
+                if (leavesRight.size() < _batchSize)
+                    setNodeChildLeaf(nodeIndex, leavesRight.begin(), leavesRight.size(), 1);
+                else {
+                    iterations.emplace_back(leavesRight.size());
+                    for (const leaf &i : leavesRight)
+                        iterations.emplace_back(i);
+
+                    setNodeChildNode(nodeIndex, _sahBegins[bestSplitIndex].getBound(), 1);
+                    ++ngroups;
+                }
+
+                leavesRight.clear();
+            }
+
+            // clear
+            for (size_t i = 0; i < nsplits; i++) {
+                _splits[i].clear();
+                _sahBegins[i].reset();
+                _sahEnds[i].reset();
+            }
+
+            ++nodeIndex;
+        }
+        return ngroups;
+    }
+
+  private:
+    static size_t GetBinIndex(single coord, single origin, single binSizeInv, size_t maxBinCount) {
         int i = static_cast<int>((coord - origin) * binSizeInv);
         return Clamp(0, maxBinCount - 1, i);
-    };
+    }
+
+    /// @brief shrinks the bound of a reference cut by a split, which is kept if the part left degenerates
+    static void Shrink(const leaf &l, bound_t &bound) {
+        const bound_t clipped = l.entity->getSurface().getClippedBound(l.entity->getTransform(), bound);
+        if (!clipped.isSingular())
+            bound = clipped;
+    }
 
-    constexpr auto sahIfInclude = [](const sah &s, const bound_t &b) {
+    static sah SahIfInclude(const sah &s, const bound_t &b) {
         sah res = s;
         res.include(b);
         res.calculateSAInv();
         return res;
-    };
+    }
 
-    auto setNodeChildLeaf = [&](size_t i, auto lo, size_t nleaves, size_t c) {
+    template <typename TIt>
+    void setNodeChildLeaf(size_t i, TIt lo, size_t nleaves, size_t c) {
         node &n = _nodes[i];
 
         n.childIsLeaf[c]     = true;
@@ -101,249 +373,802 @@ void igi::aggregate::initBuild(build_itr_queue_t iterations) {
 
         _leaves.reserve(nleaves);
         std::copy_n(lo, nleaves, std::back_inserter(_leaves));
-    };
+    }
 
-    auto setNodeChildNode = [&](size_t i, const bound_t &b, size_t c) {
+    void setNodeChildNode(size_t i, const bound_t &b, size_t c) {
         node &n = _nodes[i];
 
         n.childIsLeaf[c] = false;
         n.children[c]    = _nodes.size();
         _nodes.emplace_back();
         _nodes.back().bound = b;
+    }
+};
+
+void igi::aggregate::initBuild(build_itr_queue_t iterations, std::pmr::vector<node> &nodes, std::pmr::vector<leaf> &leaves,
+                               const aggregate_configuration &config) {
+    // builds a subtree with its own arena, so that subtrees are independent of each other
+    struct subtree {
+        mem_arena arena;
+        std::pmr::vector<node> nodes;
+        std::pmr::vector<leaf> leaves;
+        build_itr_queue_t iterations;
+
+        subtree(size_t nleaves, const bound_t &bound)
+            : arena(), nodes(&arena), leaves(&arena), iterations(nleaves * 2, &arena) {
+            nodes.reserve(nleaves - 1);
+            leaves.reserve(nleaves);
+            iterations.clear();
+
+            nodes.emplace_back();
+            nodes.back().bound = bound;
+        }
     };
 
-    // throughout the implementation, "bin" is mentioned as a abstract conception, rather than shown as a type
-
-    // sahBegins and sahEnds records leaves on right side and left side of splits
-    // e.g., all of the leaves that are on the left side of a given split "end" on the left side of the split
-    // thus, the leftmost and rightmost bins are accounted for only once
-    // sahBegins: not accounted | .. | .. |       ..
-    // sahEnds:        ..       | .. | .. | not accounted
-    sah sahBegins[MaxSplitCount], sahEnds[MaxSplitCount];
-    // split records leaves that are across the split for further cost evaluation
-    split splits[MaxSplitCount];
+    // builds with fewer leaves are not worth scheduling
+    static constexpr size_t MinParallelLeafCount = 1 << 12;
+    // more subtrees than slots are made, because they are hardly balanced
+    static constexpr size_t SubtreesPerSlot = 4;
 
-    std::pmr::vector<leaf> tmpLeaves(context::GetTypedAllocator<leaf, allocate_usage::temp>());
+    std::pmr::memory_resource *const tempResource = context::GetAllocator<allocate_usage::temp>().resource();
 
     // prepare for recursion
     single splitSAThres;
     {
-        _nodes.emplace_back();
-        bound_t &rootBound = _nodes.front().bound = bound_t::NegInf();
+        nodes.emplace_back();
+        bound_t &rootBound = nodes.front().bound = bound_t::NegInf();
         std::for_each(++iterations.begin(), iterations.end(), [&](packed_leaf &l) { rootBound.extend(l.leaf.bound); });
 
-        splitSAThres = sah::getSA(rootBound) * MinSplitRatio;
+        splitSAThres = builder::GetSplitSAThres(rootBound, config.getMinSplitRatio());
     }
 
+    thread_pool &pool      = thread_pool::GetDefault();
+    const size_t maxGroups = iterations.front().nleaves < MinParallelLeafCount ? ~static_cast<size_t>(0)
+                                                                                 : pool.getSlotCount() * SubtreesPerSlot;
+
     size_t nodeIndex = 0;
-    do {
+    const size_t ngroups = builder(nodes, leaves, config, splitSAThres, tempResource).build(iterations, nodeIndex, 1, maxGroups);
+    if (!ngroups)
+        return;
+
+    // the i-th group in the queue belongs to the i-th node from `nodeIndex`
+    subtree *const subtrees = context::Allocate<subtree, allocate_usage::temp>(ngroups);
+    for (size_t i = 0; i < ngroups; i++) {
         const size_t nleaves = iterations.front().nleaves;
         iterations.pop_front();
-        igiassert(nleaves > 1);
-
-        // caculate the numbers of bins and splits
-        const size_t nbins   = nleaves > MaxBinCount ? MaxBinCount : nleaves;
-        const size_t nsplits = nbins - 1;
-
-        // calculate bound of current node
-        bound_t &nodeBound = _nodes[nodeIndex].bound;
-        igiassert(!nodeBound.isSingular());
-
-        // determine whether attmpt to split or not
-        const bool trySplit = sah::getSA(nodeBound) > splitSAThres;
-
-        // select widest dimension of the bound
-        const vec3f diagonal      = nodeBound.getDiagonal();
-        const size_t maxDim       = MaxIcf(diagonal[0], diagonal[1], diagonal[2]);
-        const single interval     = diagonal[maxDim];
-        const single binSize      = interval / nbins;
-        const single binSizeInv   = nbins / interval;
-        const single nodeBoundMin = nodeBound.getMin(maxDim);
-
-        // traverse over leaves with adding them to bins and splits
-        std::for_each_n(iterations.begin(), nleaves, [&](packed_leaf &l) {
-            const leaf &leaf         = l.leaf;
-            const bound_t &leafBound = leaf.bound;
-
-            const auto binLo = getBinIndex(leafBound.getMin(maxDim), nodeBoundMin, binSizeInv, nbins);
-            const auto binHi = getBinIndex(leafBound.getMax(maxDim), nodeBoundMin, binSizeInv, nbins);
-            igiassert(leafBound.getMin(maxDim) >= nodeBound.getMin(maxDim));
-            igiassert(leafBound.getMax(maxDim) <= nodeBound.getMax(maxDim));
-            igiassert(binLo <= binHi);
-            igiassert(InRangeClosecf(0, nbins - 1, binLo));
-            igiassert(InRangeClosecf(0, nbins - 1, binHi));
-
-            if (binLo)
-                sahBegins[binLo - 1].include(leafBound);
-            if (binHi < nbins - 1)
-                sahEnds[binHi].include(leafBound);
-
-            for (size_t i = binLo; i < binHi; i++)
-                splits[i].add(leaf);
+
+        subtree &s = *new (subtrees + i) subtree(nleaves, nodes[nodeIndex + i].bound);
+        s.iterations.emplace_back(nleaves);
+        for (size_t j = 0; j < nleaves; j++) {
+            s.iterations.emplace_back(iterations.front().leaf);
+            iterations.pop_front();
+        }
+    }
+    igiassert(iterations.empty());
+
+    thread_pool::task_group group;
+    for (size_t i = 0; i < ngroups; i++)
+        pool.submit(group, [s = subtrees + i, &config, splitSAThres](size_t) {
+            size_t root = 0;
+            builder(s->nodes, s->leaves, config, splitSAThres, &s->arena).build(s->iterations, root, 1);
         });
+    pool.wait(group);
+
+    // subtrees are appended in queue order, their indices are offset accordingly
+    for (size_t i = 0; i < ngroups; i++) {
+        subtree &s = subtrees[i];
+
+        // the root of subtree takes the place of its placeholder, other nodes are appended
+        const size_t nodeOffset = nodes.size() - 1;
+        const size_t leafOffset = leaves.size();
+
+        auto relocate = [&](node n) {
+            for (size_t c = 0; c < 2; c++)
+                n.children[c] += n.childIsLeaf[c] ? leafOffset : nodeOffset;
+            return n;
+        };
+
+        nodes[nodeIndex + i] = relocate(s.nodes.front());
+        std::transform(s.nodes.begin() + 1, s.nodes.end(), std::back_inserter(nodes), relocate);
+        leaves.insert(leaves.end(), s.leaves.begin(), s.leaves.end());
+
+        s.~subtree();
+    }
+    context::Deallocate<allocate_usage::temp>(subtrees, ngroups);
+}
 
-        // calculate bound of union of partial bounds by adding leaves to bins previously
-        sahEnds[0].calculateSAInv();
-        sahEnds[nsplits - 1].calculateSAInv();
-        for (size_t i = 1; i < nsplits; i++) {
-            sahEnds[i].include(sahEnds[i - 1]);
-            sahBegins[nsplits - 1 - i].include(sahBegins[nsplits - i]);
+void igi::aggregate::BuildNodes(const leaf *entities, size_t n, const aggregate_configuration &config,
+                                std::pmr::vector<node> &nodes, std::pmr::vector<leaf> &leaves) {
+    igiassert(n);
+
+    if (n < 3) {
+        nodes.resize(1);
+        leaves.assign(entities, entities + n);
+        if (n == 1) {
+            new (nodes.data()) node(true, 0, false, 0, leaves[0].bound);
+            nodes.front().nchildrenLeaves[0] = 1;
+        }
+        else {
+            bound_t b = leaves[0].bound;
+            new (nodes.data()) node(true, 0, true, 1, b.extend(leaves[1].bound));
+            nodes.front().nchildrenLeaves[0] = 1;
+            nodes.front().nchildrenLeaves[1] = 1;
         }
+        return;
+    }
 
-        // estimate sah of leaves lying across splits
-        single minSAH         = SingleInf;
-        size_t bestSplitIndex = ~0;
-        {
-            // stores new leaves by split
-            std::pmr::vector<leaf> &leavesSplit = tmpLeaves;
+    if (config.getBuildMethod() != aggregate_build_method::sbvh) {
+        BuildLinearNodes(entities, n, config, nodes, leaves);
+        return;
+    }
 
-            for (size_t i = 0; i < nsplits; i++) {
-                split &split = splits[i];
-                if (!split.size())
-                    continue;
+    nodes.reserve(n - 1);
+
+    build_itr_queue_t iterations(n * 2, context::GetTypedAllocator<packed_leaf, allocate_usage::temp>());
+    iterations.resize(n + 1);
 
-                sah &sahLeft  = sahEnds[i];
-                sah &sahRight = sahBegins[i];
+    iterations.front().nleaves = n;
+    std::for_each(++iterations.begin(), iterations.end(), [&](packed_leaf &i) {
+        new (&i.leaf) leaf(*entities++);
+    });
 
-                const single splitCoord = (i + 1) * binSize + nodeBoundMin;
+    initBuild(std::move(iterations), nodes, leaves, config);
+}
 
-                single sahs[3];
-                size_t sahIndex = ~0;
-                for (auto &j : split) {
-                    leaf &leaf         = j.first;
-                    bound_t &leafBound = leaf.bound;
-                    bool &leafSide     = j.second;
+uint32_t igi::aggregate::build(const leaf *entities, size_t n, bool whole) {
+    // build nodes are discarded once flattened
+    std::pmr::vector<node> nodes(context::GetTypedAllocator<node, allocate_usage::temp>());
+    std::pmr::vector<leaf> leaves(context::GetTypedAllocator<leaf, allocate_usage::temp>());
+    BuildNodes(entities, n, _config, nodes, leaves);
+
+    std::pmr::vector<flat_node> flat(context::GetTypedAllocator<flat_node, allocate_usage::temp>());
+    flatten(flat, nodes, leaves);
+    if (whole)
+        initStatistics(flat);
+
+    if (_width != 2)
+        return collapse(flat, whole);
+
+    // second children of the subtree are offset by its position
+    const uint32_t base = static_cast<uint32_t>(_nodes.size());
+    _nodes.reserve(base + flat.size());
+    for (flat_node n : flat) {
+        if (!n.isLeaf())
+            n.offset += base;
+        _nodes.push_back(n);
+    }
+    return base;
+}
 
-                    const sah left  = sahIfInclude(sahLeft, leaf.bound);
-                    const sah right = sahIfInclude(sahRight, leaf.bound);
+void igi::aggregate::flatten(std::pmr::vector<flat_node> &flat, const std::pmr::vector<node> &nodes, const std::pmr::vector<leaf> &leaves) {
+    igiassert(leaves.size() < flat_node::BlockFlag);
 
-                    sahs[0] = left.getSAH() + sahRight.getSAH();
-                    sahs[1] = right.getSAH() + sahLeft.getSAH();
+    flat.reserve(nodes.size() * 2 + 1);
+    _prims.reserve(leaves.size());
+    _affines.reserve(leaves.size());
 
-                    // todo
-                    // it simply split the bound without shrinking it to compactly fit the leaf
-                    // more careful estimation is required
-                    sah splitLeft, splitRight;
-                    if (trySplit) {
-                        const auto [tmpMin, tmpMax] = leafBound.getInterval(maxDim);
+    // the only node of single entity has no second child
+    const node &root = nodes.front();
+    if (root.childIsLeaf[0] && !root.childIsLeaf[1] && !root.children[1])
+        flattenLeaves(flat, &leaves[root.children[0]], root.nchildrenLeaves[0]);
+    else
+        flattenNode(flat, nodes, leaves, 0);
+}
 
-                        leafBound.setMax(maxDim, splitCoord);
-                        splitLeft = sahIfInclude(sahLeft, leafBound);
-                        leafBound.setMax(maxDim, tmpMax);
+uint32_t igi::aggregate::flattenNode(std::pmr::vector<flat_node> &flat, const std::pmr::vector<node> &nodes,
+                                     const std::pmr::vector<leaf> &leaves, size_t index) {
+    const node &n        = nodes[index];
+    const uint32_t self  = static_cast<uint32_t>(flat.size());
+    uint32_t children[2] = {};
 
-                        leafBound.setMin(maxDim, splitCoord);
-                        splitRight = sahIfInclude(sahRight, leafBound);
-                        leafBound.setMin(maxDim, tmpMin);
+    flat.emplace_back();
+    for (size_t c = 0; c < 2; c++)
+        children[c] = n.childIsLeaf[c] ? flattenLeaves(flat, &leaves[n.children[c]], n.nchildrenLeaves[c])
+                                       : flattenNode(flat, nodes, leaves, n.children[c]);
+    igiassert(children[0] == self + 1);
 
-                        sahs[2] = splitLeft.getSAH() + splitRight.getSAH();
-                    }
-                    else
-                        sahs[2] = 0_sg;
-
-                    sahIndex = MinIcf(sahs[0], sahs[1], sahs[2]);
-                    switch (sahIndex) {
-                        case 0:
-                            sahLeft  = left;
-                            leafSide = false;
-                            break;
-                        case 1:
-                            sahRight = right;
-                            leafSide = true;
-                            break;
-                        default:
-                            igiassert(trySplit);
-                            leavesSplit.push_back(leaf);
-
-                            sahLeft  = splitLeft;
-                            leafSide = false;
-                            leafBound.setMax(maxDim, splitCoord);
-
-                            sahRight = splitRight;
-                            leavesSplit.back().bound.setMin(maxDim, splitCoord);
-                            break;
-                    }
-                }
-                igiassert(sahIndex != ~0);
+    flat[self] = flat_node(n.bound, children[1], n.axis);
+    return self;
+}
+
+uint32_t igi::aggregate::flattenLeaves(std::pmr::vector<flat_node> &flat, const leaf *lo, size_t nleaves) {
+    igiassert(nleaves && nleaves < flat_node::BlockFlag);
+
+    bound_t bound = bound_t::NegInf();
+    for (size_t i = 0; i < nleaves; i++)
+        bound.extend(lo[i].bound);
+
+    // leaves of triangles only are packed into blocks, which are tested at once
+    const bool triangles = std::all_of(lo, lo + nleaves, [](const leaf &l) {
+        return prim_ref(l.entity).getSurfaceType() == prim_ref::surface_type::triangle;
+    });
+
+    if (!triangles) {
+        flat.emplace_back(bound, static_cast<uint32_t>(_prims.size()), flat_node::LeafFlag | static_cast<uint32_t>(nleaves));
+        for (size_t i = 0; i < nleaves; i++) {
+            _affines.emplace_back(lo[i].entity->getTransform().getInv());
+            _prims.emplace_back(lo[i].entity);
+        }
+
+        return static_cast<uint32_t>(flat.size() - 1);
+    }
+
+    flat.emplace_back(bound, static_cast<uint32_t>(_blocks.size()),
+                      flat_node::LeafFlag | flat_node::BlockFlag | static_cast<uint32_t>(nleaves));
+    for (size_t i = 0; i < nleaves; i += triangle_block::Size) {
+        triangle_block &block = _blocks.emplace_back();
+        block.count           = static_cast<uint32_t>(std::min(nleaves - i, triangle_block::Size));
+
+        for (size_t lane = 0; lane < triangle_block::Size; lane++) {
+            // unused lanes repeat the last triangle, which are masked out by the count
+            const entity &e   = *lo[i + std::min<size_t>(lane, block.count - 1)].entity;
+            const triangle &t = static_cast<const triangle &>(e.getSurface());
+
+            block.setTriangle(lane, &e, _vertices.emplace_back(t.getVertices(e.getTransform())));
+        }
+    }
+
+    return static_cast<uint32_t>(flat.size() - 1);
+}
+
+uint32_t igi::aggregate::collapse(const std::pmr::vector<flat_node> &flat, bool whole) {
+    // the grid of quantization is undefined over infinite bounds, which is decided by the whole tree
+    if (whole && _quantized) {
+        const vec3f size = flat.front().bound.getDiagonal();
+        _quantized       = std::isfinite(size[0]) && std::isfinite(size[1]) && std::isfinite(size[2]);
+    }
+
+    return VisitWideNodes(*this, [&]<typename TNode>(std::pmr::vector<TNode> &wide) {
+        wide.reserve(wide.size() + flat.size() / (TNode::Size - 1) + 1);
+        return Collapse(wide, flat, 0);
+    });
+}
+
+/// @brief children of a wide node are gathered by repeatedly opening the interior child of the largest surface area
+template <typename TNode>
+uint32_t igi::aggregate::Collapse(std::pmr::vector<TNode> &wide, const std::pmr::vector<flat_node> &flat, uint32_t index) {
+    static constexpr size_t N = TNode::Size;
+
+    constexpr auto getSA = [](const bound_t &b) {
+        vec3f size = b.getDiagonal();
+        return size[0] * size[1] + size[1] * size[2] + size[2] * size[0];
+    };
+
+    uint32_t children[N];
+    size_t nchildren = 0;
+    if (flat[index].isLeaf())
+        children[nchildren++] = index;
+    else {
+        children[nchildren++] = index + 1;
+        children[nchildren++] = flat[index].offset;
+    }
 
-                if (minSAH > sahs[sahIndex]) {
-                    bestSplitIndex = i;
-                    minSAH         = sahs[sahIndex];
+    while (nchildren < N) {
+        size_t open  = N;
+        single maxSA = -SingleInf;
+        for (size_t i = 0; i < nchildren; i++) {
+            const flat_node &c = flat[children[i]];
+            if (!c.isLeaf() && maxSA < getSA(c.bound))
+                open = i, maxSA = getSA(c.bound);
+        }
+        if (open == N)
+            break;
+
+        const uint32_t opened = children[open];
+        children[open]        = opened + 1;
+        children[nchildren++]   = flat[opened].offset;
+    }
+
+    const uint32_t self = static_cast<uint32_t>(wide.size());
+    wide.emplace_back();
+    if constexpr (std::is_same_v<TNode, quantized_node<N>>)
+        wide[self].setBound(flat[index].bound);
+
+    for (size_t i = 0; i < N; i++) {
+        if (i >= nchildren) {
+            wide[self].setChild(i, bound_t::NegInf(), 0, flat_node::LeafFlag);
+            continue;
+        }
+
+        const flat_node &c = flat[children[i]];
+        if (c.isLeaf())
+            wide[self].setChild(i, c.bound, c.offset, c.info);
+        else {
+            const uint32_t child = Collapse(wide, flat, children[i]);
+            wide[self].setChild(i, c.bound, child, 0);
+        }
+    }
+    return self;
+}
+
+/// The stack size needed by a subtree is evaluated bottom-up, children are always placed after their parents.
+/// a binary node pushes one child while visiting the other, a wide node pushes all of its interior children and pops one of them
+void igi::aggregate::initStackSize() {
+    auto evaluate = [](size_t nnodes, auto &&getStackSize) {
+        std::pmr::vector<uint32_t> stackSizes(nnodes, context::GetTypedAllocator<uint32_t, allocate_usage::temp>());
+        for (size_t i = nnodes; i--;)
+            stackSizes[i] = getStackSize(i, stackSizes);
+        return nnodes ? stackSizes.front() : 0;
+    };
 
-                    for (leaf &j : leavesSplit)
-                        split.add(j, true);
+    auto evaluateWide = [&]<typename TNode>(const std::pmr::vector<TNode> &nodes) {
+        return evaluate(nodes.size(), [&](size_t i, const std::pmr::vector<uint32_t> &stackSizes) {
+            const TNode &n = nodes[i];
+
+            uint32_t ninterior = 0, maxChild = 0;
+            for (size_t c = 0; c < TNode::Size; c++)
+                if (!n.isLeaf(c)) {
+                    ninterior++;
+                    maxChild = std::max(maxChild, stackSizes[n.offsets[c]]);
                 }
+            return ninterior ? std::max(ninterior, ninterior - 1 + maxChild) : 0;
+        });
+    };
+
+    switch (_width) {
+        case 4:
+            _stackSize = _quantized ? evaluateWide(_quantized4) : evaluateWide(_nodes4);
+            break;
+        case 8:
+            _stackSize = _quantized ? evaluateWide(_quantized8) : evaluateWide(_nodes8);
+            break;
+        default:
+            _stackSize = evaluate(_nodes.size(), [&](size_t i, const std::pmr::vector<uint32_t> &stackSizes) {
+                const flat_node &n = _nodes[i];
+                return n.isLeaf() ? 0 : 1 + std::max(stackSizes[i + 1], stackSizes[n.offset]);
+            });
+            break;
+    }
+}
+
+/// Parents are placed before their children, thus depths are evaluated top-down in a single pass
+void igi::aggregate::initStatistics(const std::pmr::vector<flat_node> &flat) {
+    if (flat.empty())
+        return;
+
+    std::pmr::vector<uint32_t> depths(flat.size(), context::GetTypedAllocator<uint32_t, allocate_usage::temp>());
+
+    const single rootSA = GetSurfaceArea(flat.front().bound);
+    size_t depthSum     = 0;
+    single costSum      = 0_sg;
+    for (size_t i = 0; i < flat.size(); i++) {
+        const flat_node &n = flat[i];
+        const single sa    = GetSurfaceArea(n.bound);
+
+        if (!n.isLeaf()) {
+            depths[i + 1] = depths[n.offset] = depths[i] + 1;
+
+            _stats.nodeCount++;
+            costSum += sa;
+            continue;
+        }
+
+        const uint32_t count = n.getCount();
+
+        _stats.leafCount++;
+        _stats.referenceCount += count;
+        _stats.maxDepth = std::max<size_t>(_stats.maxDepth, depths[i]);
+        _stats.leafSizes[std::min<size_t>(count, aggregate_statistics::LeafSizeBinCount - 1)]++;
+
+        depthSum += depths[i];
+        costSum += sa * static_cast<single>(count);
+    }
+
+    _stats.averageDepth = static_cast<single>(depthSum) / static_cast<single>(_stats.leafCount);
+    _stats.sahCost      = rootSA > 0_sg ? costSum / rootSA : 0_sg;
+}
+
+void igi::aggregate::initCosts() {
+    std::pmr::vector<bound_t> bounds(context::GetTypedAllocator<bound_t, allocate_usage::temp>());
+    evaluate(bounds, _costs, false);
+}
+
+/// Children are placed after their parents, thus nodes are evaluated in reverse order.
+/// the cost of a node is 1 for visiting itself, plus costs of its children weighted by their relative surface areas,
+/// where the cost of a leaf is the number of its entities
+void igi::aggregate::evaluate(std::pmr::vector<bound_t> &bounds, std::pmr::vector<single> &costs, bool update) {
+    if (_width != 2) {
+        VisitWideNodes(*this, [&](auto &nodes) { evaluateWide(nodes, bounds, costs, update); });
+        return;
+    }
+
+    bounds.resize(_nodes.size());
+    costs.resize(_nodes.size());
+    for (size_t i = _nodes.size(); i--;) {
+        flat_node &n = _nodes[i];
+        if (n.isLeaf()) {
+            bounds[i] = evaluateLeaf(n.offset, n.info, update);
+            costs[i]  = static_cast<single>(n.getCount());
+        }
+        else {
+            const size_t children[2] { i + 1, n.offset };
+
+            bound_t b = bounds[children[0]];
+            b.extend(bounds[children[1]]);
+
+            const single sa = GetSurfaceArea(b);
+            single cost     = 1_sg;
+            for (size_t c : children)
+                cost += (sa > 0_sg ? GetSurfaceArea(bounds[c]) / sa : 1_sg) * costs[c];
+
+            bounds[i] = b;
+            costs[i]  = cost;
+        }
+
+        if (update)
+            n.bound = bounds[i];
+    }
+}
 
-                leavesSplit.clear();
+template <typename TNode>
+void igi::aggregate::evaluateWide(std::pmr::vector<TNode> &nodes, std::pmr::vector<bound_t> &bounds, std::pmr::vector<single> &costs, bool update) {
+    static constexpr size_t N = TNode::Size;
+
+    bounds.resize(nodes.size());
+    costs.resize(nodes.size());
+    for (size_t i = nodes.size(); i--;) {
+        TNode &n = nodes[i];
+
+        bound_t childBounds[N];
+        single childCosts[N];
+        bound_t b = bound_t::NegInf();
+        for (size_t c = 0; c < N; c++) {
+            childBounds[c] = bound_t::NegInf();
+            childCosts[c]  = 0_sg;
+            if (n.isLeaf(c) && !n.getCount(c))
+                continue;
+
+            if (n.isLeaf(c)) {
+                childBounds[c] = evaluateLeaf(n.offsets[c], n.infos[c], update);
+                childCosts[c]  = static_cast<single>(n.getCount(c));
             }
+            else {
+                childBounds[c] = bounds[n.offsets[c]];
+                childCosts[c]  = costs[n.offsets[c]];
+            }
+            b.extend(childBounds[c]);
         }
-        igiassert(bestSplitIndex != ~0);
 
-        // group leaves of left and right children nodes for next recursion
-        {
-            std::pmr::vector<leaf> &leavesRight = tmpLeaves;
+        const single sa = GetSurfaceArea(b);
+        single cost     = 1_sg;
+        for (size_t c = 0; c < N; c++)
+            if (childCosts[c] > 0_sg)
+                cost += (sa > 0_sg ? GetSurfaceArea(childBounds[c]) / sa : 1_sg) * childCosts[c];
 
-            const single splitCoord = (bestSplitIndex + 1) * binSize + nodeBoundMin;
+        bounds[i] = b;
+        costs[i]  = cost;
 
-            // emplace the number of leaves on the left side
-            const size_t leftChildrenIndex = iterations.size() - nleaves;
-            iterations.emplace_back(0);
+        if (!update)
+            continue;
 
-            size_t nleft = 0;
-            for (size_t i = 0; i < nleaves; i++) {
-                const leaf &leaf = iterations.front().leaf;
-                iterations.pop_front();
+        if constexpr (std::is_same_v<TNode, quantized_node<N>>)
+            n.setBound(b);
+        for (size_t c = 0; c < N; c++)
+            n.setChild(c, childBounds[c], n.offsets[c], n.infos[c]);
+    }
+}
 
-                if (leaf.bound.getMax(maxDim) < splitCoord) {
-                    iterations.emplace_back(leaf);
-                    nleft++;
-                }
-                else if (splitCoord < leaf.bound.getMin(maxDim))
-                    leavesRight.emplace_back(leaf);
+igi::bound_t igi::aggregate::evaluateLeaf(uint32_t offset, uint32_t info, bool update) {
+    const uint32_t count = info & ~(flat_node::LeafFlag | flat_node::BlockFlag);
+
+    bound_t res = bound_t::NegInf();
+    if (!(info & flat_node::BlockFlag)) {
+        for (uint32_t i = offset; i < offset + count; i++) {
+            const entity &e = _prims[i].getEntity();
+            if (update)
+                _affines[i] = compact_affine(e.getTransform().getInv());
+            res.extend(e.getBound());
+        }
+        return res;
+    }
+
+    for (uint32_t i = 0; i < count; i += triangle_block::Size) {
+        const size_t index    = offset + i / triangle_block::Size;
+        triangle_block &block = _blocks[index];
+        for (size_t lane = 0; lane < triangle_block::Size; lane++) {
+            const entity &e = *block.entities[lane];
+            if (update) {
+                const triangle &t = static_cast<const triangle &>(e.getSurface());
+
+                triangle_vertices &vertices = _vertices[index * triangle_block::Size + lane];
+                vertices                    = t.getVertices(e.getTransform());
+                block.setTriangle(lane, &e, vertices);
+            }
+            if (lane < block.count)
+                res.extend(e.getBound());
+        }
+    }
+    return res;
+}
+
+size_t igi::aggregate::refit(single threshold) {
+    igiassert(threshold >= 1_sg);
+
+    if (isEmpty())
+        return 0;
+
+    const auto scope = context::GetScope();
+
+    std::pmr::vector<bound_t> bounds(context::GetTypedAllocator<bound_t, allocate_usage::temp>());
+    std::pmr::vector<single> costs(context::GetTypedAllocator<single, allocate_usage::temp>());
+    evaluate(bounds, costs, true);
+
+    if (threshold == SingleInf)
+        return 0;
+
+    const size_t nrebuilt = rebuildDegraded(costs, threshold);
+    if (nrebuilt)
+        initStackSize();
+    return nrebuilt;
+}
+
+/// Subtrees are replaced by redirecting references of their parents, thus only subtrees referenced by offsets are rebuilt,
+/// which are second children of binary nodes, or any interior child of wide nodes.
+/// a degraded first child of a binary node is left to its nearest ancestor referenced by offset
+size_t igi::aggregate::rebuildDegraded(const std::pmr::vector<single> &costs, single threshold) {
+    auto isDegraded = [&](uint32_t i) { return costs[i] > _costs[i] * threshold; };
+
+    if (isDegraded(0)) {
+        const auto start = std::chrono::high_resolution_clock::now();
+
+        const std::pmr::vector<leaf> entities = gatherEntities(0);
+
+        _nodes.clear();
+        _nodes4.clear();
+        _nodes8.clear();
+        _quantized4.clear();
+        _quantized8.clear();
+        _prims.clear();
+        _affines.clear();
+        _blocks.clear();
+        _vertices.clear();
+
+        _quantized = _config.isQuantized() && _width != 2;
+        _stats     = aggregate_statistics();
+        build(entities.data(), entities.size(), true);
+        initCosts();
+
+        _stats.entityCount  = entities.size();
+        _stats.buildSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+        return 1;
+    }
+
+    const auto start = std::chrono::high_resolution_clock::now();
+
+    size_t nrebuilt = 0;
+    std::pmr::vector<uint32_t> stack(context::GetTypedAllocator<uint32_t, allocate_usage::temp>());
+    stack.push_back(0);
+    while (!stack.empty()) {
+        const uint32_t i = stack.back();
+        stack.pop_back();
+
+        if (_width == 2) {
+            if (_nodes[i].isLeaf())
+                continue;
+
+            const uint32_t second = _nodes[i].offset;
+            stack.push_back(i + 1);
+            if (_nodes[second].isLeaf() || !isDegraded(second))
+                stack.push_back(second);
+            else {
+                rebuildSubtree(second, i, 0);
+                nrebuilt++;
             }
+            continue;
+        }
+
+        VisitWideNodes(*this, [&]<typename TNode>(std::pmr::vector<TNode> &nodes) {
+            for (size_t c = 0; c < TNode::Size; c++) {
+                if (nodes[i].isLeaf(c))
+                    continue;
 
-            split &bestSplit = splits[bestSplitIndex];
-            for (auto &i : bestSplit) {
-                if (i.second)
-                    leavesRight.emplace_back(i.first);
+                const uint32_t child = nodes[i].offsets[c];
+                if (!isDegraded(child))
+                    stack.push_back(child);
                 else {
-                    iterations.emplace_back(i.first);
-                    nleft++;
+                    rebuildSubtree(child, i, c);
+                    nrebuilt++;
                 }
             }
+        });
+    }
 
-            // if there is only one leaf as child, store it directly
-            igiassert(nleft);
-            if (nleft < BatchSize) {
-                setNodeChildLeaf(nodeIndex, iterations.end() - nleft, nleft, 0);
-                iterations.pop_back(nleft + 1);
-            }
-            else {
-                iterations[leftChildrenIndex].nleaves = nleft;
+    if (nrebuilt) {
+        compact();
+        initCosts();
+        refreshStatistics(std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count());
+    }
+    return nrebuilt;
+}
 
-                setNodeChildNode(nodeIndex, sahEnds[bestSplitIndex].getBound(), 0);
-            }
+void igi::aggregate::rebuildSubtree(uint32_t node, uint32_t parent, size_t slot) {
+    const std::pmr::vector<leaf> entities = gatherEntities(node);
+    const uint32_t root                   = build(entities.data(), entities.size(), false);
 
-            igiassert(!leavesRight.empty());
-            if (leavesRight.size() < BatchSize)
-                setNodeChildLeaf(nodeIndex, leavesRight.begin(), leavesRight.size(), 1);
-            else {
-                iterations.emplace_back(leavesRight.size());
-                for (const leaf &i : leavesRight)
-                    iterations.emplace_back(i);
+    if (_width == 2)
+        _nodes[parent].offset = root;
+    else
+        VisitWideNodes(*this, [&](auto &nodes) { nodes[parent].offsets[slot] = root; });
+}
+
+/// Reachable parts are copied to scratch arrays, which are then assigned back, thus capacities of arrays are reused
+void igi::aggregate::compact() {
+    std::pmr::vector<prim_ref> prims(context::GetTypedAllocator<prim_ref, allocate_usage::temp>());
+    std::pmr::vector<compact_affine> affines(context::GetTypedAllocator<compact_affine, allocate_usage::temp>());
+    std::pmr::vector<triangle_block> blocks(context::GetTypedAllocator<triangle_block, allocate_usage::temp>());
+    std::pmr::vector<triangle_vertices> vertices(context::GetTypedAllocator<triangle_vertices, allocate_usage::temp>());
+
+    if (_width == 2) {
+        std::pmr::vector<flat_node> nodes(context::GetTypedAllocator<flat_node, allocate_usage::temp>());
+        compactBinary(nodes, 0, prims, affines, blocks, vertices);
+        _nodes.assign(nodes.begin(), nodes.end());
+    }
+    else
+        VisitWideNodes(*this, [&]<typename TNode>(std::pmr::vector<TNode> &src) {
+            std::pmr::vector<TNode> nodes(context::GetTypedAllocator<TNode, allocate_usage::temp>());
+            compactWide(nodes, src, 0, prims, affines, blocks, vertices);
+            src.assign(nodes.begin(), nodes.end());
+        });
+
+    _prims.assign(prims.begin(), prims.end());
+    _affines.assign(affines.begin(), affines.end());
+    _blocks.assign(blocks.begin(), blocks.end());
+    _vertices.assign(vertices.begin(), vertices.end());
+}
+
+template <typename TNode>
+uint32_t igi::aggregate::compactWide(std::pmr::vector<TNode> &dst, const std::pmr::vector<TNode> &src, uint32_t index,
+                                     std::pmr::vector<prim_ref> &prims, std::pmr::vector<compact_affine> &affines,
+                                     std::pmr::vector<triangle_block> &blocks, std::pmr::vector<triangle_vertices> &vertices) const {
+    const uint32_t self = static_cast<uint32_t>(dst.size());
+    dst.push_back(src[index]);
+
+    for (size_t c = 0; c < TNode::Size; c++) {
+        const TNode &n = src[index];
+        uint32_t offset;
+        if (!n.isLeaf(c))
+            offset = compactWide(dst, src, n.offsets[c], prims, affines, blocks, vertices);
+        else if (n.getCount(c))
+            offset = compactLeaf(n.offsets[c], n.infos[c], prims, affines, blocks, vertices);
+        else
+            continue;
+        // children are appended after the node, which may reallocate `dst`
+        dst[self].offsets[c] = offset;
+    }
+    return self;
+}
+
+uint32_t igi::aggregate::compactBinary(std::pmr::vector<flat_node> &dst, uint32_t index,
+                                       std::pmr::vector<prim_ref> &prims, std::pmr::vector<compact_affine> &affines,
+                                       std::pmr::vector<triangle_block> &blocks, std::pmr::vector<triangle_vertices> &vertices) const {
+    const flat_node &n  = _nodes[index];
+    const uint32_t self = static_cast<uint32_t>(dst.size());
+    dst.push_back(n);
+
+    if (n.isLeaf()) {
+        if (n.getCount())
+            dst[self].offset = compactLeaf(n.offset, n.info, prims, affines, blocks, vertices);
+        return self;
+    }
 
-                setNodeChildNode(nodeIndex, sahBegins[bestSplitIndex].getBound(), 1);
+    compactBinary(dst, index + 1, prims, affines, blocks, vertices);
+    const uint32_t second = compactBinary(dst, n.offset, prims, affines, blocks, vertices);
+    dst[self].offset      = second;
+    return self;
+}
+
+uint32_t igi::aggregate::compactLeaf(uint32_t offset, uint32_t info,
+                                     std::pmr::vector<prim_ref> &prims, std::pmr::vector<compact_affine> &affines,
+                                     std::pmr::vector<triangle_block> &blocks, std::pmr::vector<triangle_vertices> &vertices) const {
+    const uint32_t count = info & ~(flat_node::LeafFlag | flat_node::BlockFlag);
+    if (!(info & flat_node::BlockFlag)) {
+        const uint32_t res = static_cast<uint32_t>(prims.size());
+        prims.insert(prims.end(), _prims.begin() + offset, _prims.begin() + offset + count);
+        affines.insert(affines.end(), _affines.begin() + offset, _affines.begin() + offset + count);
+        return res;
+    }
+
+    const uint32_t nblocks = static_cast<uint32_t>((count + triangle_block::Size - 1) / triangle_block::Size);
+    const uint32_t res     = static_cast<uint32_t>(blocks.size());
+    blocks.insert(blocks.end(), _blocks.begin() + offset, _blocks.begin() + offset + nblocks);
+    vertices.insert(vertices.end(), _vertices.begin() + offset * triangle_block::Size,
+                    _vertices.begin() + (offset + nblocks) * triangle_block::Size);
+    return res;
+}
+
+void igi::aggregate::refreshStatistics(double seconds) {
+    aggregate_statistics stats;
+    stats.entityCount  = _stats.entityCount;
+    stats.buildSeconds = _stats.buildSeconds + seconds;
+    _stats             = stats;
+
+    if (_width == 2) {
+        initStatistics(_nodes);
+        return;
+    }
+
+    VisitWideNodes(*this, [&]<typename TNode>(const std::pmr::vector<TNode> &nodes) {
+        std::pmr::vector<uint32_t> depths(nodes.size(), context::GetTypedAllocator<uint32_t, allocate_usage::temp>());
+
+        size_t depthSum = 0;
+        for (size_t i = 0; i < nodes.size(); i++) {
+            const TNode &n = nodes[i];
+            _stats.nodeCount++;
+
+            for (size_t c = 0; c < TNode::Size; c++) {
+                if (!n.isLeaf(c)) {
+                    depths[n.offsets[c]] = depths[i] + 1;
+                    continue;
+                }
+
+                const uint32_t count = n.getCount(c);
+                if (!count)
+                    continue;
+
+                _stats.leafCount++;
+                _stats.referenceCount += count;
+                _stats.maxDepth = std::max<size_t>(_stats.maxDepth, depths[i] + 1);
+                _stats.leafSizes[std::min<size_t>(count, aggregate_statistics::LeafSizeBinCount - 1)]++;
+                depthSum += depths[i] + 1;
             }
+        }
+
+        _stats.averageDepth = _stats.leafCount ? static_cast<single>(depthSum) / static_cast<single>(_stats.leafCount) : 0_sg;
+    });
+
+    // costs of traversal nodes are evaluated by the same heuristic, relative to the surface area of the root
+    _stats.sahCost = _costs.empty() ? 0_sg : _costs.front();
+}
+
+std::pmr::vector<igi::aggregate::leaf> igi::aggregate::gatherEntities(uint32_t node) const {
+    std::pmr::vector<const entity *> entities(context::GetTypedAllocator<const entity *, allocate_usage::temp>());
 
-            leavesRight.clear();
+    auto gatherLeaf = [&](uint32_t offset, uint32_t info) {
+        const uint32_t count = info & ~(flat_node::LeafFlag | flat_node::BlockFlag);
+        if (!(info & flat_node::BlockFlag)) {
+            for (uint32_t i = offset; i < offset + count; i++)
+                entities.push_back(&_prims[i].getEntity());
+            return;
         }
 
-        // clear
-        for (size_t i = 0; i < nsplits; i++) {
-            splits[i].clear();
-            sahBegins[i].reset();
-            sahEnds[i].reset();
+        for (uint32_t i = 0; i < count; i++)
+            entities.push_back(_blocks[offset + i / triangle_block::Size].entities[i % triangle_block::Size]);
+    };
+
+    std::pmr::vector<uint32_t> stack(context::GetTypedAllocator<uint32_t, allocate_usage::temp>());
+    stack.push_back(node);
+    while (!stack.empty()) {
+        const uint32_t i = stack.back();
+        stack.pop_back();
+
+        if (_width == 2) {
+            const flat_node &n = _nodes[i];
+            if (n.isLeaf())
+                gatherLeaf(n.offset, n.info);
+            else {
+                stack.push_back(i + 1);
+                stack.push_back(n.offset);
+            }
+            continue;
         }
 
-        ++nodeIndex;
-    } while (iterations.size());
+        VisitWideNodes(*this, [&]<typename TNode>(const std::pmr::vector<TNode> &nodes) {
+            const TNode &n = nodes[i];
+            for (size_t c = 0; c < TNode::Size; c++)
+                if (!n.isLeaf(c))
+                    stack.push_back(n.offsets[c]);
+                else if (n.getCount(c))
+                    gatherLeaf(n.offsets[c], n.infos[c]);
+        });
+    }
+
+    // entities cut by spatial splits are referenced by more than one leaf
+    std::sort(entities.begin(), entities.end());
+    entities.erase(std::unique(entities.begin(), entities.end()), entities.end());
+
+    std::pmr::vector<leaf> res(context::GetTypedAllocator<leaf, allocate_usage::temp>());
+    res.reserve(entities.size());
+    for (const entity *e : entities)
+        res.emplace_back(*e, e->getBound());
+    return res;
 }
@@ -0,0 +1,252 @@
+﻿#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <unordered_map>
+#include "igiscene/aggregate.h"
+#include "igiutilities/mapped_file.h"
+
+/// The cache file is the header followed by raw arrays of traversal nodes, entity indices of `_prims`,
+/// and entity indices of `_blocks`. entities are referenced by indices in the order they're given,
+/// while data baked from their transforms is baked again on load, which is linear in the number of entities.
+/// the file is in the native layout of the platform, which is validated by the key along with entities
+
+namespace {
+    struct cache_header {
+        // "IBVH" in little-endian
+        static constexpr uint32_t Magic   = 0x48564249;
+        static constexpr uint32_t Version = 1;
+
+        uint32_t magic;
+        uint32_t version;
+        uint64_t key;
+        uint32_t width;
+        uint32_t quantized;
+        uint64_t nnodes;
+        uint64_t nprims;
+        uint64_t nblocks;
+        igi::aggregate_statistics stats;
+    };
+
+    struct cache_block {
+        uint32_t count;
+        uint32_t entities[4];
+    };
+
+    /// @brief 64-bit FNV-1a
+    class cache_hasher {
+        uint64_t _hash = 0xcbf29ce484222325;
+
+      public:
+        void mix(const void *p, size_t n) {
+            const unsigned char *bytes = static_cast<const unsigned char *>(p);
+            for (size_t i = 0; i < n; i++)
+                _hash = (_hash ^ bytes[i]) * 0x100000001b3;
+        }
+
+        template <typename T>
+        void mix(const T &v) {
+            static_assert(std::is_arithmetic_v<T>);
+            mix(&v, sizeof(T));
+        }
+
+        void mix(const igi::vec3f &v) {
+            for (size_t i = 0; i < 3; i++)
+                mix(v[i]);
+        }
+
+        uint64_t get() const {
+            return _hash;
+        }
+    };
+}  // namespace
+
+uint64_t igi::aggregate::GetCacheKey(const leaf *entities, size_t n, const aggregate_configuration &config) {
+    cache_hasher hasher;
+
+    // layouts of nodes and blocks differ across platforms and precisions
+    for (size_t size : { sizeof(cache_header), sizeof(single), sizeof(flat_node), sizeof(wide_node<4>), sizeof(wide_node<8>),
+                         sizeof(quantized_node<4>), sizeof(quantized_node<8>), triangle_block::Size })
+        hasher.mix(static_cast<uint64_t>(size));
+
+    hasher.mix(static_cast<uint64_t>(config.getWidth()));
+    hasher.mix(config.isQuantized());
+    hasher.mix(static_cast<uint64_t>(config.getBinCount()));
+    hasher.mix(static_cast<uint64_t>(config.getBatchSize()));
+    hasher.mix(config.getMinSplitRatio());
+    hasher.mix(static_cast<uint32_t>(config.getBuildMethod()));
+
+    // bounds clipped by spatial splits depend on vertices of triangles, and on bounds of other surfaces only
+    hasher.mix(static_cast<uint64_t>(n));
+    for (size_t i = 0; i < n; i++) {
+        const entity &e    = *entities[i].entity;
+        const prim_ref ref(&e);
+        const mat4x4f &mat = e.getTransform().getMat();
+
+        hasher.mix(static_cast<uint32_t>(ref.getSurfaceType()));
+        for (size_t r = 0; r < 4; r++)
+            for (size_t c = 0; c < 4; c++)
+                hasher.mix(mat.get(r, c));
+        hasher.mix(entities[i].bound.getMin());
+        hasher.mix(entities[i].bound.getMax());
+
+        if (ref.getSurfaceType() == prim_ref::surface_type::triangle) {
+            const triangle_vertices vertices = static_cast<const triangle &>(e.getSurface()).getVertices(e.getTransform());
+            for (const vec3f &p : vertices.positions)
+                hasher.mix(p);
+        }
+    }
+
+    return hasher.get();
+}
+
+bool igi::aggregate::loadCache(const leaf *entities, size_t n, uint64_t key) {
+    const mapped_file file(_config.getCachePath());
+    if (!file.isOpen() || file.getSize() < sizeof(cache_header))
+        return false;
+
+    cache_header header;
+    std::memcpy(&header, file.getData(), sizeof(cache_header));
+    if (header.magic != cache_header::Magic || header.version != cache_header::Version || header.key != key ||
+        header.width != _width || (header.quantized && !_quantized))
+        return false;
+
+    // quantization is turned off by unbounded entities when built
+    _quantized = header.quantized;
+
+    auto reject = [&] {
+        _nodes.clear();
+        _nodes4.clear();
+        _nodes8.clear();
+        _quantized4.clear();
+        _quantized8.clear();
+        _prims.clear();
+        _affines.clear();
+        _blocks.clear();
+        _vertices.clear();
+        _quantized = _config.isQuantized() && _width != 2;
+        return false;
+    };
+
+    const size_t nodeSize = _width == 2 ? sizeof(flat_node)
+                                        : VisitWideNodes(*this, []<typename TNode>(const std::pmr::vector<TNode> &) { return sizeof(TNode); });
+    if (file.getSize() != sizeof(cache_header) + header.nnodes * nodeSize + header.nprims * sizeof(uint32_t) +
+                              header.nblocks * sizeof(cache_block))
+        return reject();
+
+    // the mapping isn't aligned for nodes, which are copied as a whole
+    const std::byte *p = file.getData() + sizeof(cache_header);
+    auto copyNodes     = [&]<typename TNode>(std::pmr::vector<TNode> &nodes) {
+        nodes.resize(header.nnodes);
+        std::memcpy(nodes.data(), p, header.nnodes * sizeof(TNode));
+        p += header.nnodes * sizeof(TNode);
+    };
+    if (_width == 2)
+        copyNodes(_nodes);
+    else
+        VisitWideNodes(*this, copyNodes);
+
+    bool valid = true;
+    auto getEntity = [&](uint32_t index) -> const entity & {
+        valid &= index < n;
+        return *entities[index < n ? index : 0].entity;
+    };
+
+    _prims.reserve(header.nprims);
+    _affines.reserve(header.nprims);
+    for (size_t i = 0; i < header.nprims; i++, p += sizeof(uint32_t)) {
+        uint32_t index;
+        std::memcpy(&index, p, sizeof(uint32_t));
+
+        const entity &e = getEntity(index);
+        _affines.emplace_back(e.getTransform().getInv());
+        _prims.emplace_back(&e);
+    }
+
+    _blocks.reserve(header.nblocks);
+    _vertices.reserve(header.nblocks * triangle_block::Size);
+    for (size_t i = 0; i < header.nblocks && valid; i++, p += sizeof(cache_block)) {
+        cache_block cached;
+        std::memcpy(&cached, p, sizeof(cache_block));
+
+        triangle_block &block = _blocks.emplace_back();
+        block.count           = cached.count;
+        for (size_t lane = 0; lane < triangle_block::Size; lane++) {
+            const entity &e = getEntity(cached.entities[lane]);
+            if (!valid || prim_ref(&e).getSurfaceType() != prim_ref::surface_type::triangle) {
+                valid = false;
+                break;
+            }
+
+            const triangle &t = static_cast<const triangle &>(e.getSurface());
+            block.setTriangle(lane, &e, _vertices.emplace_back(t.getVertices(e.getTransform())));
+        }
+    }
+
+    if (!valid)
+        return reject();
+
+    _stats        = header.stats;
+    _stats.cached = true;
+    return true;
+}
+
+void igi::aggregate::saveCache(const leaf *entities, size_t n, uint64_t key) const {
+    std::pmr::unordered_map<const entity *, uint32_t> indices(context::GetTypedAllocator<std::pair<const entity *const, uint32_t>, allocate_usage::temp>());
+    indices.reserve(n);
+    for (size_t i = 0; i < n; i++)
+        indices.emplace(entities[i].entity, static_cast<uint32_t>(i));
+
+    static_assert(std::size(cache_block().entities) == triangle_block::Size);
+
+    cache_header header {};
+    header.magic     = cache_header::Magic;
+    header.version   = cache_header::Version;
+    header.key       = key;
+    header.width     = static_cast<uint32_t>(_width);
+    header.quantized = _quantized;
+    header.nprims    = _prims.size();
+    header.nblocks   = _blocks.size();
+    header.stats     = _stats;
+
+    // written aside and then renamed, so that a partial file is never loaded by other processes
+    const std::filesystem::path path(_config.getCachePath());
+    std::filesystem::path temp = path;
+    temp += ".tmp";
+
+    bool written = false;
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        if (!out)
+            return;
+
+        auto writeNodes = [&]<typename TNode>(const std::pmr::vector<TNode> &nodes) {
+            header.nnodes = nodes.size();
+            out.write(reinterpret_cast<const char *>(&header), sizeof(cache_header));
+            out.write(reinterpret_cast<const char *>(nodes.data()), static_cast<std::streamsize>(nodes.size() * sizeof(TNode)));
+        };
+        if (_width == 2)
+            writeNodes(_nodes);
+        else
+            VisitWideNodes(*this, writeNodes);
+
+        for (const prim_ref &prim : _prims) {
+            const uint32_t index = indices.at(&prim.getEntity());
+            out.write(reinterpret_cast<const char *>(&index), sizeof(uint32_t));
+        }
+
+        for (const triangle_block &block : _blocks) {
+            cache_block cached { block.count, {} };
+            for (size_t lane = 0; lane < triangle_block::Size; lane++)
+                cached.entities[lane] = indices.at(block.entities[lane]);
+            out.write(reinterpret_cast<const char *>(&cached), sizeof(cache_block));
+        }
+
+        written = static_cast<bool>(out.flush());
+    }
+
+    std::error_code ec;
+    if (written)
+        std::filesystem::rename(temp, path, ec);
+    if (!written || ec)
+        std::filesystem::remove(temp, ec);
+}
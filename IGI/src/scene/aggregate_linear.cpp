@@ -0,0 +1,469 @@
+﻿#include <numeric>
+#include "igiacceleration/mem_arena.h"
+#include "igiacceleration/thread_pool.h"
+#include "igimath/mcode.h"
+#include "igiscene/aggregate.h"
+#include "igiutilities/igiassert.h"
+
+/// This is an implementation of LBVH and HLBVH, see pbrt 4.3.3.
+/// entities are sorted along z-order curve by Morton codes of their centroids, thus nearby entities are adjacent.
+/// the sorted entities are cut into clusters of the same top bits of codes, each of which is built concurrently
+/// by splitting at the highest bit its codes differ in. top levels over clusters are split the same way by `lbvh`,
+/// or by binned surface area heuristic by `hlbvh`
+
+class igi::aggregate::linear_builder {
+  public:
+    struct morton_ref {
+        uint64_t code;
+        uint32_t index;
+    };
+
+    /// @brief entities of the same top bits of codes, which are in [lo, hi) of sorted references
+    struct cluster {
+        size_t lo, hi;
+        bound_t bound;
+    };
+
+    /// @brief cluster left to be built, which is referenced by the `slot`-th child of `_nodes[node]`
+    struct pending_cluster {
+        size_t node, slot;
+        size_t lo, hi;
+        // root of the subtree built from the cluster, which is local to the subtree
+        size_t root;
+    };
+
+    /// @brief bits of each dimension of centroids, which fill 63 bits of codes
+    static constexpr size_t CoordBits = 21;
+    static constexpr unsigned MaxCoord = (1u << CoordBits) - 1;
+    /// @brief clusters share the top 4 bits of each dimension, i.e., they're cells of a 16^3 grid over centroids
+    static constexpr size_t ClusterCoordBits = 4;
+    static constexpr size_t ClusterShift     = (CoordBits - ClusterCoordBits) * 3;
+
+  private:
+    std::pmr::vector<node> &_nodes;
+    std::pmr::vector<leaf> &_leaves;
+
+    const leaf *const _entities;
+    const morton_ref *const _refs;
+
+    const size_t _batchSize;
+
+  public:
+    linear_builder(std::pmr::vector<node> &nodes, std::pmr::vector<leaf> &leaves, const leaf *entities, const morton_ref *refs,
+                   size_t batchSize)
+        : _nodes(nodes), _leaves(leaves), _entities(entities), _refs(refs), _batchSize(batchSize) { }
+
+    linear_builder(const linear_builder &) = delete;
+    linear_builder(linear_builder &&)      = delete;
+
+    /// @brief emits the subtree of sorted references in [lo, hi) at `_nodes[index]`
+    /// @return bound of the subtree
+    bound_t build(size_t index, size_t lo, size_t hi) {
+        igiassert(hi - lo > 1);
+
+        uint8_t axis;
+        const size_t mid   = FindSplit(_refs, lo, hi, &axis);
+        _nodes[index].axis = axis;
+
+        bound_t b = setChild(index, 0, lo, mid);
+        b.extend(setChild(index, 1, mid, hi));
+        return _nodes[index].bound = b;
+    }
+
+    /// @brief emits top levels over clusters in [lo, hi) at `_nodes[index]`, clusters of no fewer entities than the batch size
+    /// are left to be built concurrently, which are recorded in `pending`
+    /// @param sah whether top levels are split by surface area heuristic, which reorders clusters, or by codes
+    bound_t buildTop(size_t index, cluster *lo, cluster *hi, bool sah, size_t binCount, std::pmr::vector<pending_cluster> &pending) {
+        igiassert(hi - lo > 1);
+
+        uint8_t axis;
+        cluster *mid = sah ? splitBySah(lo, hi, binCount, &axis) : splitByCodes(lo, hi, &axis);
+        _nodes[index].axis = axis;
+
+        auto setTopChild = [&](size_t c, cluster *clo, cluster *chi) {
+            if (chi - clo > 1) {
+                const size_t child = newChild(index, c);
+                return buildTop(child, clo, chi, sah, binCount, pending);
+            }
+            if (clo->hi - clo->lo < _batchSize)
+                return setChild(index, c, clo->lo, clo->hi);
+
+            _nodes[index].childIsLeaf[c] = false;
+            pending.push_back({ index, c, clo->lo, clo->hi, 0 });
+            return clo->bound;
+        };
+
+        bound_t b = setTopChild(0, lo, mid);
+        b.extend(setTopChild(1, mid, hi));
+        return _nodes[index].bound = b;
+    }
+
+    static void Encode(const leaf *entities, size_t n, morton_ref *refs, thread_pool &pool, size_t nchunks);
+
+    /// @brief LSD radix sort by codes, each pass of which counts and scatters chunks concurrently
+    static void Sort(std::pmr::vector<morton_ref> &refs, thread_pool &pool, size_t nchunks);
+
+    /// @brief calls `fn(chunk, lo, hi)` for `nchunks` chunks of [0, n) concurrently
+    template <typename TFn>
+    static void ForEachChunk(thread_pool &pool, size_t n, size_t nchunks, TFn &&fn) {
+        const size_t chunkSize = (n + nchunks - 1) / nchunks;
+        if (nchunks == 1) {
+            fn(0, 0, n);
+            return;
+        }
+
+        thread_pool::task_group group;
+        for (size_t i = 0; i < nchunks; i++)
+            pool.submit(group, [&fn, i, chunkSize, n](size_t) {
+                fn(i, std::min(i * chunkSize, n), std::min((i + 1) * chunkSize, n));
+            });
+        pool.wait(group);
+    }
+
+  private:
+    /// @brief leaf group of fewer entities than the batch size, or a new interior node otherwise
+    bound_t setChild(size_t index, size_t c, size_t lo, size_t hi) {
+        if (hi - lo >= _batchSize)
+            return build(newChild(index, c), lo, hi);
+
+        node &n              = _nodes[index];
+        n.childIsLeaf[c]     = true;
+        n.children[c]        = _leaves.size();
+        n.nchildrenLeaves[c] = hi - lo;
+
+        bound_t b = bound_t::NegInf();
+        for (size_t i = lo; i < hi; i++) {
+            const leaf &l = _entities[_refs[i].index];
+            b.extend(l.bound);
+            _leaves.push_back(l);
+        }
+        return b;
+    }
+
+    size_t newChild(size_t index, size_t c) {
+        const size_t child = _nodes.size();
+        _nodes.emplace_back();
+
+        _nodes[index].childIsLeaf[c] = false;
+        _nodes[index].children[c]    = child;
+        return child;
+    }
+
+    /// @brief splits clusters at the highest bit their codes differ in, which is above bits within clusters
+    cluster *splitByCodes(cluster *lo, cluster *hi, uint8_t *axis) const {
+        const size_t mid = FindSplit(_refs, lo->lo, (hi - 1)->hi, axis);
+        return std::partition_point(lo, hi, [&](const cluster &c) { return c.lo < mid; });
+    }
+
+    /// @return the first reference of the upper side, which is the middle if all codes are the same
+    static size_t FindSplit(const morton_ref *refs, size_t lo, size_t hi, uint8_t *axis) {
+        const uint64_t diff = refs[lo].code ^ refs[hi - 1].code;
+        if (!diff) {
+            *axis = 0;
+            return lo + (hi - lo) / 2;
+        }
+
+        // the i-th bit of codes belongs to the (i % 3)-th dimension, references below share bits above it
+        const int bit = 63 - std::countl_zero(diff);
+        *axis         = static_cast<uint8_t>(bit % 3);
+        return std::partition_point(refs + lo, refs + hi, [&](const morton_ref &r) { return !(r.code >> bit & 1); }) - refs;
+    }
+
+    static unsigned GetCell(const cluster &c, const morton_ref *refs, size_t dim);
+
+    /// @brief splits clusters by binned surface area heuristic over their cells, which are distinct from each other
+    cluster *splitBySah(cluster *lo, cluster *hi, size_t binCount, uint8_t *axis) const;
+};
+
+void igi::aggregate::linear_builder::Encode(const leaf *entities, size_t n, morton_ref *refs, thread_pool &pool, size_t nchunks) {
+    auto getCentroid = [](const bound_t &b) { return (b.getMin() + b.getMax()) * .5_sg; };
+    auto isFinite    = [](const vec3f &p) { return std::isfinite(p[0]) && std::isfinite(p[1]) && std::isfinite(p[2]); };
+
+    // centroids of unbounded entities are left out, which are then encoded as the lowest corner
+    std::pmr::vector<bound_t> bounds(nchunks, bound_t::NegInf(), context::GetTypedAllocator<bound_t, allocate_usage::temp>());
+    ForEachChunk(pool, n, nchunks, [&](size_t chunk, size_t lo, size_t hi) {
+        for (size_t i = lo; i < hi; i++) {
+            const vec3f c = getCentroid(entities[i].bound);
+            if (isFinite(c))
+                bounds[chunk].extend(c);
+        }
+    });
+
+    bound_t centroidBound = bound_t::NegInf();
+    for (const bound_t &b : bounds)
+        if (b.getMin(0) <= b.getMax(0))
+            centroidBound.extend(b.getMin()).extend(b.getMax());
+
+    const vec3f size = centroidBound.getDiagonal();
+    const vec3f scale([&](size_t i, size_t) { return size[i] > 0_sg ? static_cast<single>(MaxCoord) / size[i] : 0_sg; });
+
+    ForEachChunk(pool, n, nchunks, [&](size_t, size_t lo, size_t hi) {
+        for (size_t i = lo; i < hi; i++) {
+            const vec3f c = getCentroid(entities[i].bound);
+            const vec3u coord([&](size_t j, size_t) {
+                const single q = (c[j] - centroidBound.getMin(j)) * scale[j];
+                // nan is produced by infinite centroids, which fails both comparisons
+                return q > 0_sg ? q < static_cast<single>(MaxCoord) ? static_cast<unsigned>(q) : MaxCoord : 0u;
+            });
+
+            refs[i].code  = mcode<3>(coord);
+            refs[i].index = static_cast<uint32_t>(i);
+        }
+    });
+}
+
+/// Each pass counts digits of chunks concurrently, the counts are then summed up by digit and then by chunk,
+/// so that every chunk scatters its references to its own ranges, which keeps the sort stable
+void igi::aggregate::linear_builder::Sort(std::pmr::vector<morton_ref> &refs, thread_pool &pool, size_t nchunks) {
+    static constexpr size_t DigitBits   = 11;
+    static constexpr size_t BucketCount = static_cast<size_t>(1) << DigitBits;
+    static constexpr uint64_t DigitMask = BucketCount - 1;
+
+    const size_t n = refs.size();
+
+    std::pmr::vector<morton_ref> temp(n, context::GetTypedAllocator<morton_ref, allocate_usage::temp>());
+    std::pmr::vector<size_t> offsets(nchunks * BucketCount, context::GetTypedAllocator<size_t, allocate_usage::temp>());
+
+    morton_ref *src = refs.data(), *dst = temp.data();
+    for (size_t shift = 0; shift < CoordBits * 3; shift += DigitBits) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        ForEachChunk(pool, n, nchunks, [&](size_t chunk, size_t lo, size_t hi) {
+            size_t *counts = &offsets[chunk * BucketCount];
+            for (size_t i = lo; i < hi; i++)
+                counts[src[i].code >> shift & DigitMask]++;
+        });
+
+        // a digit shared by all references leaves the order as is
+        size_t sum = 0;
+        bool skip  = false;
+        for (size_t d = 0; d < BucketCount; d++) {
+            const size_t base = sum;
+            for (size_t chunk = 0; chunk < nchunks; chunk++) {
+                const size_t count = offsets[chunk * BucketCount + d];
+                offsets[chunk * BucketCount + d] = sum;
+                sum += count;
+            }
+            skip |= sum - base == n;
+        }
+        if (skip)
+            continue;
+
+        ForEachChunk(pool, n, nchunks, [&](size_t chunk, size_t lo, size_t hi) {
+            size_t *dsts = &offsets[chunk * BucketCount];
+            for (size_t i = lo; i < hi; i++)
+                dst[dsts[src[i].code >> shift & DigitMask]++] = src[i];
+        });
+        std::swap(src, dst);
+    }
+
+    if (src != refs.data())
+        std::copy_n(src, n, refs.data());
+}
+
+unsigned igi::aggregate::linear_builder::GetCell(const cluster &c, const morton_ref *refs, size_t dim) {
+    const uint64_t code = refs[c.lo].code >> ClusterShift;
+
+    unsigned res = 0;
+    for (size_t i = 0; i < ClusterCoordBits; i++)
+        res |= static_cast<unsigned>(code >> (i * 3 + dim) & 1) << i;
+    return res;
+}
+
+igi::aggregate::linear_builder::cluster *igi::aggregate::linear_builder::splitBySah(cluster *lo, cluster *hi, size_t binCount,
+                                                                                  uint8_t *axis) const {
+    static constexpr unsigned CellCount = 1u << ClusterCoordBits;
+
+    // split along the dimension of the widest range of cells
+    unsigned minCells[3], extents[3];
+    for (size_t dim = 0; dim < 3; dim++) {
+        unsigned minCell = CellCount, maxCell = 0;
+        for (const cluster *c = lo; c != hi; c++) {
+            const unsigned cell = GetCell(*c, _refs, dim);
+            minCell             = std::min(minCell, cell);
+            maxCell             = std::max(maxCell, cell);
+        }
+        minCells[dim] = minCell;
+        extents[dim]  = maxCell - minCell + 1;
+    }
+    const size_t dim = std::max_element(extents, extents + 3) - extents;
+    *axis            = static_cast<uint8_t>(dim);
+
+    // distinct clusters differ in cells along some dimension, thus both ends of the widest one fall in different bins
+    const size_t nbins = std::min<size_t>(binCount, extents[dim]);
+    igiassert(nbins > 1);
+
+    auto getBin = [&](const cluster &c) { return (GetCell(c, _refs, dim) - minCells[dim]) * nbins / extents[dim]; };
+
+    bound_t bounds[aggregate_configuration::MaxBinCount];
+    size_t counts[aggregate_configuration::MaxBinCount] = {};
+    std::fill_n(bounds, nbins, bound_t::NegInf());
+    for (const cluster *c = lo; c != hi; c++) {
+        const size_t bin = getBin(*c);
+        bounds[bin].extend(c->bound);
+        counts[bin] += c->hi - c->lo;
+    }
+
+    // costs of unbounded clusters are infinite, in which case the first split of both sides non-empty is taken
+    single costs[aggregate_configuration::MaxBinCount];
+    {
+        bound_t b    = bound_t::NegInf();
+        size_t count = 0;
+        for (size_t i = 0; i + 1 < nbins; i++) {
+            b.extend(bounds[i]);
+            count += counts[i];
+            costs[i] = count ? GetSurfaceArea(b) * static_cast<single>(count) : SingleInf;
+        }
+
+        b     = bound_t::NegInf();
+        count = 0;
+        for (size_t i = nbins - 1; i > 0; i--) {
+            b.extend(bounds[i]);
+            count += counts[i];
+            costs[i - 1] = count ? costs[i - 1] + GetSurfaceArea(b) * static_cast<single>(count) : SingleInf;
+        }
+    }
+
+    size_t best = nbins;
+    for (size_t i = 0; i + 1 < nbins; i++)
+        if (costs[i] < SingleInf && (best == nbins || costs[i] < costs[best]))
+            best = i;
+    if (best == nbins)
+        for (size_t i = 0; i + 1 < nbins && best == nbins; i++) {
+            const size_t left = std::accumulate(counts, counts + i + 1, static_cast<size_t>(0));
+            if (left && std::accumulate(counts + i + 1, counts + nbins, static_cast<size_t>(0)))
+                best = i;
+        }
+    igiassert(best != nbins);
+
+    return std::partition(lo, hi, [&](const cluster &c) { return getBin(c) <= best; });
+}
+
+void igi::aggregate::BuildLinearNodes(const leaf *entities, size_t n, const aggregate_configuration &config,
+                                      std::pmr::vector<node> &nodes, std::pmr::vector<leaf> &leaves) {
+    using morton_ref      = linear_builder::morton_ref;
+    using cluster         = linear_builder::cluster;
+    using pending_cluster = linear_builder::pending_cluster;
+
+    // builds a subtree of clusters with its own arena, so that subtrees are independent of each other
+    struct subtree {
+        mem_arena arena;
+        std::pmr::vector<node> nodes;
+        std::pmr::vector<leaf> leaves;
+
+        subtree(size_t nleaves) : arena(), nodes(&arena), leaves(&arena) {
+            nodes.reserve(nleaves);
+            leaves.reserve(nleaves);
+        }
+    };
+
+    // builds with fewer leaves are not worth scheduling
+    static constexpr size_t MinParallelLeafCount = 1 << 12;
+    // more subtrees than slots are made, because clusters are hardly balanced
+    static constexpr size_t SubtreesPerSlot = 4;
+
+    igiassert(n > 2 && n <= std::numeric_limits<uint32_t>::max());
+
+    thread_pool &pool     = thread_pool::GetDefault();
+    const bool parallel   = n >= MinParallelLeafCount;
+    const size_t nchunks  = parallel ? pool.getSlotCount() : 1;
+    const size_t batch    = config.getBatchSize();
+    const bool sah        = config.getBuildMethod() == aggregate_build_method::hlbvh;
+
+    std::pmr::vector<morton_ref> refs(n, context::GetTypedAllocator<morton_ref, allocate_usage::temp>());
+    linear_builder::Encode(entities, n, refs.data(), pool, nchunks);
+    linear_builder::Sort(refs, pool, nchunks);
+
+    nodes.reserve(n - 1);
+    leaves.reserve(n);
+    nodes.emplace_back();
+
+    linear_builder builder(nodes, leaves, entities, refs.data(), batch);
+
+    // clusters are pointless for a single thread, unless top levels are built by surface area heuristic
+    std::pmr::vector<cluster> clusters(context::GetTypedAllocator<cluster, allocate_usage::temp>());
+    if (parallel || sah)
+        for (size_t i = 0; i < n; i++) {
+            if (!i || refs[i].code >> linear_builder::ClusterShift != refs[i - 1].code >> linear_builder::ClusterShift)
+                clusters.push_back({ i, i, bound_t::NegInf() });
+            clusters.back().hi = i + 1;
+            clusters.back().bound.extend(entities[refs[i].index].bound);
+        }
+
+    if (clusters.size() < 2) {
+        builder.build(0, 0, n);
+        return;
+    }
+
+    std::pmr::vector<pending_cluster> pending(context::GetTypedAllocator<pending_cluster, allocate_usage::temp>());
+    builder.buildTop(0, clusters.data(), clusters.data() + clusters.size(), sah, config.getBinCount(), pending);
+    if (pending.empty())
+        return;
+
+    // pending clusters are grouped into subtrees of about the same numbers of entities
+    const size_t maxSubtrees = std::min(pending.size(), parallel ? pool.getSlotCount() * SubtreesPerSlot : 1);
+    std::pmr::vector<size_t> groups(context::GetTypedAllocator<size_t, allocate_usage::temp>());
+    {
+        size_t npending = 0;
+        for (const pending_cluster &p : pending)
+            npending += p.hi - p.lo;
+
+        const size_t target = (npending + maxSubtrees - 1) / maxSubtrees;
+        size_t count        = 0;
+        groups.push_back(0);
+        for (size_t i = 0; i < pending.size(); i++) {
+            count += pending[i].hi - pending[i].lo;
+            if (count >= target || i + 1 == pending.size()) {
+                groups.push_back(i + 1);
+                count = 0;
+            }
+        }
+    }
+    const size_t nsubtrees = groups.size() - 1;
+
+    subtree *const subtrees = context::Allocate<subtree, allocate_usage::temp>(nsubtrees);
+    for (size_t i = 0; i < nsubtrees; i++) {
+        size_t nleaves = 0;
+        for (size_t j = groups[i]; j < groups[i + 1]; j++)
+            nleaves += pending[j].hi - pending[j].lo;
+        new (subtrees + i) subtree(nleaves);
+    }
+
+    auto buildSubtree = [s = subtrees, p = pending.data(), g = groups.data(), entities, r = refs.data(), batch](size_t i) {
+        linear_builder builder(s[i].nodes, s[i].leaves, entities, r, batch);
+        for (size_t j = g[i]; j < g[i + 1]; j++) {
+            p[j].root = s[i].nodes.size();
+            s[i].nodes.emplace_back();
+            builder.build(p[j].root, p[j].lo, p[j].hi);
+        }
+    };
+
+    if (nsubtrees == 1)
+        buildSubtree(0);
+    else {
+        thread_pool::task_group group;
+        for (size_t i = 0; i < nsubtrees; i++)
+            pool.submit(group, [&buildSubtree, i](size_t) { buildSubtree(i); });
+        pool.wait(group);
+    }
+
+    // subtrees are appended in order, their indices are offset accordingly
+    for (size_t i = 0; i < nsubtrees; i++) {
+        subtree &s = subtrees[i];
+
+        const size_t nodeOffset = nodes.size();
+        const size_t leafOffset = leaves.size();
+
+        std::transform(s.nodes.begin(), s.nodes.end(), std::back_inserter(nodes), [&](node n) {
+            for (size_t c = 0; c < 2; c++)
+                n.children[c] += n.childIsLeaf[c] ? leafOffset : nodeOffset;
+            return n;
+        });
+        leaves.insert(leaves.end(), s.leaves.begin(), s.leaves.end());
+
+        for (size_t j = groups[i]; j < groups[i + 1]; j++)
+            nodes[pending[j].node].children[pending[j].slot] = nodeOffset + pending[j].root;
+
+        s.~subtree();
+    }
+    context::Deallocate<allocate_usage::temp>(subtrees, nsubtrees);
+}
@@ -0,0 +1,68 @@
+﻿#include "igiutilities/mapped_file.h"
+#include <string>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+igi::mapped_file::mapped_file(std::string_view path) {
+    const std::string p(path);
+
+    _file = CreateFileA(p.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (_file == INVALID_HANDLE_VALUE) {
+        _file = nullptr;
+        return;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(_file, &size) || !size.QuadPart)
+        return;
+
+    _mapping = CreateFileMappingA(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!_mapping)
+        return;
+
+    _data = static_cast<const std::byte *>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+    if (_data)
+        _size = static_cast<size_t>(size.QuadPart);
+}
+
+igi::mapped_file::~mapped_file() {
+    if (_data)
+        UnmapViewOfFile(_data);
+    if (_mapping)
+        CloseHandle(_mapping);
+    if (_file)
+        CloseHandle(_file);
+}
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+igi::mapped_file::mapped_file(std::string_view path) {
+    const std::string p(path);
+
+    const int fd = open(p.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+
+    // the mapping is kept after the descriptor is closed
+    struct stat st;
+    if (!fstat(fd, &st) && st.st_size > 0) {
+        void *data = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            _data = static_cast<const std::byte *>(data);
+            _size = static_cast<size_t>(st.st_size);
+        }
+    }
+    close(fd);
+}
+
+igi::mapped_file::~mapped_file() {
+    if (_data)
+        munmap(const_cast<std::byte *>(_data), _size);
+}
+#endif